@@ -11,6 +11,7 @@ struct KSong_t
 {
 	MusSong song;
 	CydWavetableEntry wavetable_entries[CYD_WAVE_MAX_ENTRIES];
+	MusTimeIndex time_index;
 };
 
 
@@ -22,6 +23,18 @@ struct KPlayer_t
 };
 
 
+/* Songs are never edited so identical samples can be shared between all loaded songs */
+
+static void share_wavetable(KSong *song)
+{
+	int i = 0;
+	for (i = 0 ; i < CYD_WAVE_MAX_ENTRIES ; ++i)
+	{
+		cyd_wave_entry_share(&song->wavetable_entries[i]);
+	}
+}
+
+
 KLYSAPI KSong* KSND_LoadSong(KPlayer* player, const char *path)
 {
 	KSong *song = calloc(sizeof(*song), 1);
@@ -34,6 +47,8 @@ KLYSAPI KSong* KSND_LoadSong(KPlayer* player, const char *path)
 
 	if (mus_load_song(path, &song->song, song->wavetable_entries))
 	{
+		share_wavetable(song);
+		mus_build_time_index(&song->song, player ? player->cyd.sample_rate : 0, &song->time_index);
 		return song;
 	}
 	else
@@ -43,38 +58,8 @@ KLYSAPI KSong* KSND_LoadSong(KPlayer* player, const char *path)
 	}
 }
 
-#ifndef USESDL_RWOPS
-static int RWread(struct RWops *context, void *ptr, int size, int maxnum)
-{
-	const int len = my_min(size * maxnum, context->mem.length - context->mem.ptr);
-	memcpy(ptr, context->mem.base + context->mem.ptr, len);
-
-	context->mem.ptr += len;
-
-	return len;
-}
-
-
-static int RWclose(struct RWops *context)
-{
-	free(context);
-	return 1;
-}
-#endif
-
-
 KLYSAPI KSong* KSND_LoadSongFromMemory(KPlayer* player, void *data, int data_size)
 {
-#ifndef USESDL_RWOPS
-	RWops *ops = calloc(sizeof(*ops), 1);
-	ops->read = RWread;
-	ops->close = RWclose;
-	ops->mem.base = data;
-	ops->mem.length = data_size;
-#else
-	RWops *ops = SDL_RWFromMem(data, data_size);
-#endif
-
 	KSong *song = calloc(sizeof(*song), 1);
 
 	int i = 0;
@@ -83,18 +68,15 @@ KLYSAPI KSong* KSND_LoadSongFromMemory(KPlayer* player, void *data, int data_siz
 		cyd_wave_entry_init(&song->wavetable_entries[i], NULL, 0, 0, 0, 0, 0);
 	}
 
-	if (mus_load_song_RW(ops, &song->song, song->wavetable_entries))
+	if (mus_load_song_from_memory(data, data_size, &song->song, song->wavetable_entries))
 	{
+		share_wavetable(song);
+		mus_build_time_index(&song->song, player ? player->cyd.sample_rate : 0, &song->time_index);
 		return song;
 	}
 	else
 	{
 		free(song);
-#ifndef USESDL_RWOPS
-		RWclose(ops);
-#else
-		SDL_RWclose(ops);
-#endif
 		return NULL;
 	}
 }
@@ -108,6 +90,7 @@ KLYSAPI void KSND_FreeSong(KSong *song)
 		cyd_wave_entry_init(&song->wavetable_entries[i], NULL, 0, 0, 0, 0, 0);
 	}
 
+	mus_free_time_index(&song->time_index);
 	mus_free_song(&song->song);
 	free(song);
 }
@@ -143,6 +126,9 @@ KLYSAPI KPlayer* KSND_CreatePlayerUnregistered(int sample_rate)
 	cyd_init(&player->cyd, sample_rate, 1);
 	mus_init_engine(&player->mus, &player->cyd);
 
+	// Songs are never edited so they can be compiled for faster playback
+	player->mus.flags |= MUS_COMPILE_SONG;
+
 	// Each song has its own wavetable array so let's free this
 	free(player->cyd.wavetable_entries);
 	player->cyd.wavetable_entries = NULL;
@@ -157,6 +143,18 @@ KLYSAPI void KSND_SetPlayerQuality(KPlayer *player, int oversample)
 }
 
 
+KLYSAPI void KSND_SetPlayerBandlimited(KPlayer *player, int enable)
+{
+	cyd_set_bandlimited(&player->cyd, enable);
+}
+
+
+KLYSAPI void KSND_SetPlayerControlRateEnvelope(KPlayer *player, int enable)
+{
+	cyd_set_control_rate_envelope(&player->cyd, enable);
+}
+
+
 KLYSAPI void KSND_FreePlayer(KPlayer *player)
 {
 	KSND_Stop(player);
@@ -197,6 +195,18 @@ KLYSAPI int KSND_FillBuffer(KPlayer *player, short int *buffer, int buffer_lengt
 }
 
 
+KLYSAPI int KSND_FillBufferPlanar(KPlayer *player, int *left, int *right, int frames)
+{
+	return cyd_output_buffer_planar(&player->cyd, (Sint32*)left, (Sint32*)right, frames);
+}
+
+
+KLYSAPI int KSND_FillBufferFloat(KPlayer *player, float *left, float *right, int frames)
+{
+	return cyd_output_buffer_planar_float(&player->cyd, left, right, frames);
+}
+
+
 KLYSAPI void KSND_Stop(KPlayer *player)
 {
 	mus_set_song(&player->mus, NULL, 0);
@@ -266,5 +276,14 @@ KLYSAPI void KSND_SetLooping(KPlayer *player, int looping)
 
 KLYSAPI int KSND_GetPlayTime(KSong *song, int position)
 {
-	return mus_get_playtime_at(&song->song, position);
+	if (song->time_index.num_rows == 0)
+		return mus_get_playtime_at(&song->song, position);
+
+	return mus_get_indexed_playtime_at(&song->time_index, position);
+}
+
+
+KLYSAPI int KSND_GetPositionAtTime(KSong *song, int time)
+{
+	return mus_get_position_at_time(&song->time_index, my_max(0, time));
 }
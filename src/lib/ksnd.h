@@ -69,6 +69,9 @@ KLYSAPI extern KSong * KSND_LoadSongFromMemory(KPlayer* player, void *data, int
 /**
  * Free memory reserved for a @c KSong instance
  *
+ * Sample data identical between loaded songs is stored only once and is
+ * released when the last song using it is freed.
+ *
  * @param song song to be freed
  */
 KLYSAPI extern void KSND_FreeSong(KSong *song);
@@ -102,12 +105,25 @@ KLYSAPI extern const KSongInfo * KSND_GetSongInfo(KSong *song, KSongInfo *data);
  * Use this in conjunction with KSND_GetPlayPosition() to find out the current playback 
  * time. Or, use with KSND_GetSongLength() to get the song duration.
  *
+ * The play times are calculated once when the song is loaded so this is cheap to call
+ * e.g. every frame.
+ *
  * @param song song whose play time is polled
  * @param position 
  * @return @c position measured in milliseconds
  */
 KLYSAPI extern int KSND_GetPlayTime(KSong *song, int position);
 
+/**
+ * Returns the pattern row that is playing @a time milliseconds after the song was started
+ * from the beginning. This is the reverse of KSND_GetPlayTime().
+ *
+ * @param song song whose position is polled
+ * @param time milliseconds from the beginning of the song
+ * @return pattern row
+ */
+KLYSAPI extern int KSND_GetPositionAtTime(KSong *song, int time);
+
 /**
  * Create a @c KPlayer context and playback thread.
  *
@@ -167,6 +183,34 @@ KLYSAPI extern void KSND_Pause(KPlayer *player, int state);
  */
 KLYSAPI extern int KSND_FillBuffer(KPlayer *player, short int *buffer, int buffer_length);
 
+/**
+ * Fill separate left and right buffers of 32-bit signed integers with audio.
+ *
+ * Unlike KSND_FillBuffer() the buffers are overwritten and the data is not clamped. 
+ * Full scale is [-32768..32767]. Use only with a @c KPlayer context created with KSND_CreatePlayerUnregistered().
+ *
+ * @param player player context
+ * @param[out] left buffer for the left channel
+ * @param[out] right buffer for the right channel
+ * @param frames number of samples to fill in each buffer
+ * @return number of samples output
+ */
+KLYSAPI extern int KSND_FillBufferPlanar(KPlayer *player, int *left, int *right, int frames);
+
+/**
+ * Fill separate left and right buffers of floats with audio.
+ *
+ * Unlike KSND_FillBuffer() the buffers are overwritten and the data is not clamped. 
+ * Full scale is [-1.0..1.0]. Use only with a @c KPlayer context created with KSND_CreatePlayerUnregistered().
+ *
+ * @param player player context
+ * @param[out] left buffer for the left channel
+ * @param[out] right buffer for the right channel
+ * @param frames number of samples to fill in each buffer
+ * @return number of samples output
+ */
+KLYSAPI extern int KSND_FillBufferFloat(KPlayer *player, float *left, float *right, int frames);
+
 /**
  * Set player oversampling quality.
  *
@@ -179,6 +223,30 @@ KLYSAPI extern int KSND_FillBuffer(KPlayer *player, short int *buffer, int buffe
  */
 KLYSAPI extern void KSND_SetPlayerQuality(KPlayer *player, int oversample);
 
+/**
+ * Enable or disable band-limited oscillators.
+ *
+ * When enabled, channels playing a plain pulse, saw or triangle wave generate it once per sample 
+ * with PolyBLEP antialiasing instead of oversampling. This is much less CPU intensive at high 
+ * oversample rates. Other waveforms are not affected. Can be adjusted realtime.
+ *
+ * @param player @c KPlayer context
+ * @param enable 1 to enable, 0 to disable
+ */
+KLYSAPI extern void KSND_SetPlayerBandlimited(KPlayer *player, int enable);
+
+/**
+ * Enable or disable control-rate envelopes.
+ *
+ * When enabled, the volume envelopes are updated every few samples and the volume is ramped 
+ * linearly in between instead of updating the envelope every sample. The output is very close 
+ * but not identical. Can be adjusted realtime.
+ *
+ * @param player @c KPlayer context
+ * @param enable 1 to enable, 0 to disable
+ */
+KLYSAPI extern void KSND_SetPlayerControlRateEnvelope(KPlayer *player, int enable);
+
 /**
  * Set playback volume.
  *
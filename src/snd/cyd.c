@@ -49,6 +49,24 @@ OTHER DEALINGS IN THE SOFTWARE.
 
 #endif
 
+#ifdef CYD_PROFILE
+
+static inline Uint64 cyd_profile_counter(void)
+{
+#if SDL_VERSION_ATLEAST(2,0,0)
+	return SDL_GetPerformanceCounter();
+#else
+	return SDL_GetTicks();
+#endif
+}
+
+# define CYD_PROFILE_START(timer) const Uint64 timer = cyd_profile_counter()
+# define CYD_PROFILE_STOP(timer, counter) (counter) += cyd_profile_counter() - (timer)
+#else
+# define CYD_PROFILE_START(timer)
+# define CYD_PROFILE_STOP(timer, counter)
+#endif
+
 #define envspd(cyd,slope) (slope!=0?(((Uint64)0xff0000 / ((slope) * (slope) * 256 / (ENVELOPE_SCALE * ENVELOPE_SCALE))) * CYD_BASE_FREQ / cyd->sample_rate):((Uint64)0xff0000 * CYD_BASE_FREQ / cyd->sample_rate))
 
 // used lfsr-generator <http://lfsr-generator.sourceforge.net/> for this:
@@ -146,6 +164,9 @@ void cyd_init(CydEngine *cyd, Uint16 sample_rate, int channels)
 
 	cyd_init_log_tables(cyd);
 
+	cyd->block = calloc(1, sizeof(*cyd->block));
+	cyd->commands = calloc(1, sizeof(*cyd->commands));
+
 	for (int i = 0 ; i < CYD_MAX_FX_CHANNELS ; ++i)
 		cydfx_init(&cyd->fx[i], sample_rate);
 #ifndef CYD_DISABLE_WAVETABLE
@@ -155,7 +176,49 @@ void cyd_init(CydEngine *cyd, Uint16 sample_rate, int channels)
 #endif
 
 	cyd_reserve_channels(cyd, channels);
+
+#ifdef CYD_PROFILE
+	cyd_reset_profile(cyd);
+#endif
+}
+
+
+#ifdef CYD_PROFILE
+void cyd_reset_profile(CydEngine *cyd)
+{
+	cyd_lock(cyd, 1);
+
+	memset(&cyd->profile, 0, sizeof(cyd->profile));
+	memset(cyd->profile_channel, 0, sizeof(cyd->profile_channel));
+
+#if SDL_VERSION_ATLEAST(2,0,0)
+	cyd->profile.frequency = SDL_GetPerformanceFrequency();
+#else
+	cyd->profile.frequency = 1000;
+#endif
+
+	cyd_lock(cyd, 0);
+}
+
+
+void cyd_get_profile(CydEngine *cyd, CydProfile *profile)
+{
+	cyd_lock(cyd, 1);
+
+	*profile = cyd->profile;
+
+	for (int c = 0 ; c < CYD_MAX_CHANNELS ; ++c)
+	{
+		for (int s = 0 ; s < CYD_PROFILE_STAGES ; ++s)
+		{
+			profile->channel[c] += cyd->profile_channel[c][s];
+			profile->stage[s] += cyd->profile_channel[c][s];
+		}
+	}
+
+	cyd_lock(cyd, 0);
 }
+#endif
 
 
 void cyd_set_oversampling(CydEngine *cyd, int oversampling)
@@ -164,6 +227,32 @@ void cyd_set_oversampling(CydEngine *cyd, int oversampling)
 }
 
 
+void cyd_set_control_rate_envelope(CydEngine *cyd, int enable)
+{
+	cyd_lock(cyd, 1);
+
+	if (enable)
+		cyd->flags |= CYD_CONTROL_RATE_ENVELOPE;
+	else
+		cyd->flags &= ~CYD_CONTROL_RATE_ENVELOPE;
+
+	cyd_lock(cyd, 0);
+}
+
+
+void cyd_set_bandlimited(CydEngine *cyd, int enable)
+{
+	cyd_lock(cyd, 1);
+
+	if (enable)
+		cyd->flags |= CYD_BANDLIMITED;
+	else
+		cyd->flags &= ~CYD_BANDLIMITED;
+
+	cyd_lock(cyd, 0);
+}
+
+
 void cyd_reserve_channels(CydEngine *cyd, int channels)
 {
 	debug("Reserving %d Cyd channels", channels);
@@ -187,6 +276,8 @@ void cyd_reserve_channels(CydEngine *cyd, int channels)
 
 void cyd_deinit(CydEngine *cyd)
 {
+	cyd_set_threads(cyd, 1);
+
 	if (cyd->lookup_table)
 	{
 		free(cyd->lookup_table);
@@ -207,6 +298,18 @@ void cyd_deinit(CydEngine *cyd)
 		cyd->channel = NULL;
 	}
 
+	if (cyd->block)
+	{
+		free(cyd->block);
+		cyd->block = NULL;
+	}
+
+	if (cyd->commands)
+	{
+		free(cyd->commands);
+		cyd->commands = NULL;
+	}
+
 	for (int i = 0 ; i < CYD_MAX_FX_CHANNELS ; ++i)
 		cydfx_deinit(&cyd->fx[i]);
 
@@ -366,6 +469,89 @@ Uint32 cyd_cycle_adsr(const CydEngine *eng, Uint32 flags, Uint32 ym_env_shape, C
 }
 
 
+#ifndef CYD_DISABLE_ENVELOPE
+/* Advance a SID style envelope by n samples at once, the result is the same as calling cyd_cycle_adsr() n times */
+
+static Uint32 cyd_advance_adsr(const CydEngine *eng, Uint32 flags, CydAdsr *adsr, int n)
+{
+	while (n > 0)
+	{
+		switch (adsr->envelope_state)
+		{
+			case ATTACK:
+			{
+				if (adsr->env_speed == 0 && adsr->envelope < 0xff0000)
+					return flags;
+
+				// steps until the envelope reaches the top, including the step that does
+				const Uint32 k = adsr->envelope >= 0xff0000 ? 1 : (0xff0000 - adsr->envelope + adsr->env_speed - 1) / adsr->env_speed;
+
+				if (k > (Uint32)n)
+				{
+					adsr->envelope += n * adsr->env_speed;
+					return flags;
+				}
+
+				n -= k;
+				adsr->envelope_state = DECAY;
+				adsr->envelope = 0xff0000;
+				adsr->env_speed = envspd(eng, adsr->d);
+			}
+			break;
+
+			case DECAY:
+			{
+				const Uint32 sustain = (Uint32)adsr->s << 19;
+
+				if (adsr->env_speed == 0 && adsr->envelope > sustain)
+					return flags;
+
+				// steps that only decrease the envelope
+				const Uint32 k = adsr->envelope > sustain ? (adsr->envelope - sustain - 1) / adsr->env_speed : 0;
+
+				if (k >= (Uint32)n)
+				{
+					adsr->envelope -= n * adsr->env_speed;
+					return flags;
+				}
+
+				n -= k + 1;
+				adsr->envelope = sustain;
+				adsr->envelope_state = (adsr->s == 0) ? RELEASE : SUSTAIN;
+				adsr->env_speed = envspd(eng, adsr->r);
+			}
+			break;
+
+			case RELEASE:
+			{
+				if (adsr->env_speed == 0 && adsr->envelope > 0)
+					return flags;
+
+				const Uint32 k = adsr->envelope > 0 ? (adsr->envelope - 1) / adsr->env_speed : 0;
+
+				if (k >= (Uint32)n)
+				{
+					adsr->envelope -= n * adsr->env_speed;
+					return flags;
+				}
+
+				n -= k + 1;
+				adsr->envelope_state = DONE;
+				if ((flags & (CYD_CHN_ENABLE_WAVE|CYD_CHN_WAVE_OVERRIDE_ENV)) != (CYD_CHN_ENABLE_WAVE|CYD_CHN_WAVE_OVERRIDE_ENV)) flags &= ~CYD_CHN_ENABLE_GATE;
+				adsr->envelope = 0;
+			}
+			break;
+
+			default:
+				return flags;
+		}
+	}
+
+	return flags;
+}
+#endif
+
+
 #ifndef CYD_DISABLE_LFSR
 static void run_lfsrs(CydChannel *chn)
 {
@@ -383,10 +569,8 @@ static void run_lfsrs(CydChannel *chn)
 #endif
 
 
-static void cyd_cycle_channel(CydEngine *cyd, CydChannel *chn)
+static void cyd_cycle_wave_fm(CydEngine *cyd, CydChannel *chn)
 {
-	chn->flags = cyd_cycle_adsr(cyd, chn->flags, chn->ym_env_shape, &chn->adsr);
-
 	if (chn->flags & CYD_CHN_ENABLE_WAVE)
 	{
 		for (int i = 0 ; i < CYD_SUB_OSCS ; ++i)
@@ -402,21 +586,49 @@ static void cyd_cycle_channel(CydEngine *cyd, CydChannel *chn)
 }
 
 
-static void cyd_sync_channel(CydEngine *cyd, CydChannel *chn)
+static void cyd_cycle_channel(CydEngine *cyd, CydChannel *chn)
+{
+	chn->flags = cyd_cycle_adsr(cyd, chn->flags, chn->ym_env_shape, &chn->adsr);
+	cyd_cycle_wave_fm(cyd, chn);
+}
+
+
+static int cyd_sync_triggered(const CydEngine *cyd, const CydChannel *chn, int frame)
+{
+	return (chn->flags & CYD_CHN_ENABLE_SYNC) && cyd->block->sync[chn->sync_source][frame];
+}
+
+
+static void cyd_sync_oscillators(CydChannel *chn)
 {
-	if ((chn->flags & CYD_CHN_ENABLE_SYNC) && cyd->channel[chn->sync_source].sync_bit)
+	for (int i = 0 ; i < CYD_SUB_OSCS ; ++i)
 	{
-		for (int i = 0 ; i < CYD_SUB_OSCS ; ++i)
-		{
-			chn->subosc[i].wave.acc = 0;
-			chn->subosc[i].wave.direction = 0;
-			chn->subosc[i].accumulator = 0;
-			chn->subosc[i].random = RANDOM_SEED;
-			chn->subosc[i].reg4 = 1;
-			chn->subosc[i].reg5 = 1;
-			chn->subosc[i].reg9 = 1;
-			chn->subosc[i].lfsr_ctr = 0;
-		}
+		chn->subosc[i].accumulator = 0;
+		chn->subosc[i].random = RANDOM_SEED;
+		chn->subosc[i].reg4 = 1;
+		chn->subosc[i].reg5 = 1;
+		chn->subosc[i].reg9 = 1;
+		chn->subosc[i].lfsr_ctr = 0;
+	}
+}
+
+
+static void cyd_sync_wave(CydChannel *chn)
+{
+	for (int i = 0 ; i < CYD_SUB_OSCS ; ++i)
+	{
+		chn->subosc[i].wave.acc = 0;
+		chn->subosc[i].wave.direction = 0;
+	}
+}
+
+
+static void cyd_sync_channel(CydEngine *cyd, CydChannel *chn, int frame)
+{
+	if (cyd_sync_triggered(cyd, chn, frame))
+	{
+		cyd_sync_wave(chn);
+		cyd_sync_oscillators(chn);
 	}
 }
 
@@ -425,6 +637,13 @@ static void cyd_advance_oscillators(CydEngine *cyd, CydChannel *chn)
 {
 	for (int s = 0 ; s < CYD_SUB_OSCS ; ++s)
 	{
+#ifndef CYD_DISABLE_LFSR
+		if (chn->subosc[s].frequency == 0 && !(chn->flags & CYD_CHN_ENABLE_LFSR))
+#else
+		if (chn->subosc[s].frequency == 0)
+#endif
+			continue; // a stopped oscillator would not change
+
 		Uint32 prev_acc = chn->subosc[s].accumulator;
 		chn->subosc[s].accumulator = (chn->subosc[s].accumulator + (Uint32)chn->subosc[s].frequency);
 
@@ -497,10 +716,53 @@ static void cyd_advance_oscillators(CydEngine *cyd, CydChannel *chn)
 }
 
 
+static int cyd_channel_is_bandlimited(const CydEngine *cyd, const CydChannel *chn)
+{
+#ifndef CYD_DISABLE_FM
+	if (chn->flags & CYD_CHN_ENABLE_FM)
+		return 0;
+#endif
+
+	return (cyd->flags & CYD_BANDLIMITED) && cyd_osc_is_bandlimited(chn->flags);
+}
+
+
+/* Runs the oscillators once per sample instead of oversampling, see cyd_osc_bandlimited() */
+
+static Sint32 cyd_output_channel_bandlimited(CydEngine *cyd, CydChannel *chn)
+{
+	Sint32 ovr = 0;
+
+	chn->sync_bit = 0;
+
+	for (int s = 0 ; s < CYD_SUB_OSCS ; ++s)
+	{
+		const Uint32 step = chn->subosc[s].frequency << cyd->oversample;
+
+		if (step != 0)
+			ovr += cyd_osc_bandlimited(chn->flags, chn->subosc[s].accumulator, step, chn->pw) - WAVE_AMP / 2;
+
+		chn->subosc[s].accumulator += step;
+
+		/* only subosc #0 can set the sync bit */
+
+		if (s == 0)
+			chn->sync_bit |= chn->subosc[s].accumulator & ACC_LENGTH;
+
+		chn->subosc[s].accumulator &= ACC_LENGTH - 1;
+	}
+
+	return ovr;
+}
+
+
 static Sint32 cyd_output_channel(CydEngine *cyd, CydChannel *chn)
 {
 	Sint32 ovr = 0;
 
+	if (cyd_channel_is_bandlimited(cyd, chn))
+		return cyd_output_channel_bandlimited(cyd, chn);
+
 	chn->sync_bit = 0;
 
 #ifndef CYD_DISABLE_FM
@@ -533,6 +795,19 @@ static Sint32 cyd_output_channel(CydEngine *cyd, CydChannel *chn)
 }
 
 
+#ifndef CYD_DISABLE_ENVELOPE
+/* SID style envelope as a 16.16 gain, excluding volume. Same scale as in cyd_env_output() */
+
+static Sint32 cyd_env_gain(const CydEngine *cyd, const CydAdsr *adsr)
+{
+	if (adsr->envelope_state == ATTACK)
+		return ((Sint32)adsr->envelope / 0x10000) * 256;
+	else
+		return cyd->lookup_table[(adsr->envelope / (65536*256 / LUT_SIZE) ) & (LUT_SIZE - 1)];
+}
+#endif
+
+
 Sint32 cyd_env_output(const CydEngine *cyd, Uint32 chn_flags, const CydAdsr *adsr, Sint32 input)
 {
 	if (chn_flags & CYD_CHN_ENABLE_YM_ENV)
@@ -558,142 +833,882 @@ Sint32 cyd_env_output(const CydEngine *cyd, Uint32 chn_flags, const CydAdsr *ads
 }
 
 
-#ifdef STEREOOUTPUT
-static void cyd_output(CydEngine *cyd, Sint32 *left, Sint32 *right)
-#else
-static Sint32 cyd_output(CydEngine *cyd)
-#endif
+/* Render the oscillators of a channel for the whole block. The oscillator state is stepped first
+   and the waveforms are then evaluated for all oversampled steps at once with cyd_osc_block().
+   Only valid when nothing else in the channel affects the oscillators, i.e. no FM, and
+   when the channel is not using the band-limited oscillators */
+
+static void cyd_render_oscillators(CydEngine *cyd, CydMixBuffer *mix, int idx, int frames, Sint32 *output)
 {
-#ifdef STEREOOUTPUT
-	*left = *right = 0;
-	Sint32 fx_l[CYD_MAX_FX_CHANNELS] = {0}, fx_r[CYD_MAX_FX_CHANNELS] = {0};
-#else
-	Sint32 v = 0, fx_input[CYD_MAX_FX_CHANNELS] = {0};
-#endif
-	Sint32 s[CYD_MAX_CHANNELS];
+	CydChannel *chn = &cyd->channel[idx];
+	CydBlock *block = cyd->block;
+	const int steps = 1 << cyd->oversample;
+	const int chunk = my_max(1, CYD_OSC_LANES >> cyd->oversample);
 
-	for (int i = 0 ; i < cyd->n_channels ; ++i)
+	for (int start = 0 ; start < frames ; start += chunk)
 	{
-		s[i] = (Sint32)cyd_output_channel(cyd, &cyd->channel[i]);
-#ifndef CYD_DISABLE_WAVETABLE
-		if ((cyd->channel[i].flags & CYD_CHN_ENABLE_WAVE) && cyd->channel[i].wave_entry && !(cyd->channel[i].flags & CYD_CHN_WAVE_OVERRIDE_ENV))
+		const int n = my_min(chunk, frames - start);
+
+		for (int f = 0 ; f < n ; ++f)
 		{
-			for (int sub = 0 ; sub < CYD_SUB_OSCS ; ++sub)
+			chn->sync_bit = 0;
+
+			for (int i = 0 ; i < steps ; ++i)
 			{
-				if (cyd->channel[i].subosc[sub].wave.playing && cyd->channel[i].subosc[sub].wave.frequency != 0)
+				const int lane = f * steps + i;
+
+				for (int s = 0 ; s < CYD_SUB_OSCS ; ++s)
 				{
-#ifdef CYD_DISABLE_FM
-					CydWaveAcc accumulator = cyd->channel[i].subosc[sub].wave.acc;
-#else
-					CydWaveAcc accumulator = (cyd->channel[i].flags & CYD_CHN_ENABLE_FM) ? cydfm_modulate_wave(cyd, &cyd->channel[i].fm, cyd->channel[i].wave_entry, cyd->channel[i].subosc[sub].wave.acc) : cyd->channel[i].subosc[sub].wave.acc;
-#endif
-					s[i] += cyd_wave_get_sample(&cyd->channel[i].subosc[sub].wave, cyd->channel[i].wave_entry, accumulator);
+					mix->osc_acc[s][lane] = chn->subosc[s].accumulator;
+					mix->osc_random[s][lane] = chn->subosc[s].random;
+					mix->osc_lfsr[s][lane] = chn->subosc[s].lfsr_acc;
 				}
+
+				cyd_advance_oscillators(cyd, chn);
+
+#ifndef CYD_DISABLE_FM
+				cydfm_cycle_oversample(cyd, &chn->fm);
+#endif
 			}
+
+			block->sync[idx][start + f] = chn->sync_bit != 0;
+
+			if (cyd_sync_triggered(cyd, chn, start + f))
+				cyd_sync_oscillators(chn);
 		}
-#endif
-	}
 
-	for (int i = 0 ; i < cyd->n_channels ; ++i)
-	{
-		CydChannel *chn = &cyd->channel[i];
-		Sint32 o = 0;
-		if (chn->flags & CYD_CHN_ENABLE_GATE)
+		Sint32 ovr[CYD_BLOCK_SIZE] = {0};
+
+		for (int s = 0 ; s < CYD_SUB_OSCS ; ++s)
 		{
-			if (chn->flags & CYD_CHN_ENABLE_RING_MODULATION)
-			{
-				o = cyd_env_output(cyd, chn->flags, &chn->adsr, s[i] * (s[chn->ring_mod] + (WAVE_AMP / 2)) / WAVE_AMP);
-			}
-			else
+			if (chn->subosc[s].frequency == 0)
+				continue;
+
+			cyd_osc_block(chn->flags, mix->osc_acc[s], chn->pw, mix->osc_random[s], mix->osc_lfsr[s], mix->osc_output, n * steps);
+
+			for (int f = 0 ; f < n ; ++f)
 			{
-				o = cyd_env_output(cyd, chn->flags, &chn->adsr, s[i]);
+				for (int i = 0 ; i < steps ; ++i)
+					ovr[f] += mix->osc_output[f * steps + i] - WAVE_AMP / 2;
 			}
+		}
+
+		for (int f = 0 ; f < n ; ++f)
+			output[start + f] = ovr[f] >> cyd->oversample;
+	}
+}
+
 
 #ifndef CYD_DISABLE_WAVETABLE
-			if ((cyd->channel[i].flags & CYD_CHN_ENABLE_WAVE) && cyd->channel[i].wave_entry && (cyd->channel[i].flags & CYD_CHN_WAVE_OVERRIDE_ENV))
-			{
-				for (int s = 0 ; s < CYD_SUB_OSCS ; ++s)
-				{
-					if (cyd->channel[i].subosc[s].wave.playing && cyd->channel[i].subosc[s].wave.frequency != 0)
-					{
+static Sint32 cyd_wave_sample(CydEngine *cyd, CydChannel *chn, int sub)
+{
+	if (chn->subosc[sub].wave.playing && chn->subosc[sub].wave.frequency != 0)
+	{
 #ifdef CYD_DISABLE_FM
-						CydWaveAcc accumulator = cyd->channel[i].subosc[s].wave.acc;
+		CydWaveAcc accumulator = chn->subosc[sub].wave.acc;
 #else
-						CydWaveAcc accumulator = (cyd->channel[i].flags & CYD_CHN_ENABLE_FM) ? cydfm_modulate_wave(cyd, &cyd->channel[i].fm, cyd->channel[i].wave_entry, cyd->channel[i].subosc[s].wave.acc) : cyd->channel[i].subosc[s].wave.acc;
+		CydWaveAcc accumulator = (chn->flags & CYD_CHN_ENABLE_FM) ? cydfm_modulate_wave(cyd, &chn->fm, chn->wave_entry, chn->subosc[sub].wave.acc) : chn->subosc[sub].wave.acc;
 #endif
-						o += cyd_wave_get_sample(&cyd->channel[i].subosc[s].wave, chn->wave_entry, accumulator) * (Sint32)(chn->adsr.volume) / MAX_VOLUME;
-					}
-				}
-			}
+		return cyd_wave_get_sample(&chn->subosc[sub].wave, chn->wave_entry, accumulator);
+	}
+	
+	return 0;
+}
 #endif
 
-#ifndef CYD_DISABLE_FILTER
-			if (chn->flags & CYD_CHN_ENABLE_FILTER)
-			{
-				cydflt_cycle(&chn->flt, o);
-				switch (chn->flttype)
-				{
-					case FLT_BP: o = cydflt_output_bp(&chn->flt); break;
-					default: case FLT_LP: o = cydflt_output_lp(&chn->flt); break;
-					case FLT_HP: o = cydflt_output_hp(&chn->flt); break;
-				}
-			}
-#endif
 
-#ifdef STEREOOUTPUT
-			Sint32 ol = o * chn->gain_left / CYD_STEREO_GAIN, or = o * chn->gain_right / CYD_STEREO_GAIN;
+/* Sum of the wavetable sub-oscillators mixed before (override = 0) or after the envelope (override = CYD_CHN_WAVE_OVERRIDE_ENV).
+   wave is the output of cyd_render_waves() or NULL if the waves are sampled and cycled frame by frame */
+
+static Sint32 cyd_wave_output(CydEngine *cyd, CydChannel *chn, Sint32 (*wave)[CYD_BLOCK_SIZE], int frame, Uint32 override)
+{
+	Sint32 o = 0;
+
+#ifndef CYD_DISABLE_WAVETABLE
+	if ((chn->flags & CYD_CHN_ENABLE_WAVE) && chn->wave_entry && (chn->flags & CYD_CHN_WAVE_OVERRIDE_ENV) == override)
+	{
+		for (int sub = 0 ; sub < CYD_SUB_OSCS ; ++sub)
+		{
+			const Sint32 s = wave ? wave[sub][frame] : cyd_wave_sample(cyd, chn, sub);
+
+			if (override)
+				o += s * (Sint32)(chn->adsr.volume) / MAX_VOLUME;
+			else
+				o += s;
+		}
+	}
 #endif
 
-			if (chn->flags & CYD_CHN_ENABLE_FX)
-			{
+	return o;
+}
+
+
+static Sint32 cyd_channel_source(CydEngine *cyd, CydChannel *chn, Sint32 (*wave)[CYD_BLOCK_SIZE], int frame, Sint32 s)
+{
+	return s + cyd_wave_output(cyd, chn, wave, frame, 0);
+}
+
+
+/* Render the wavetable sub-oscillators of a channel for the whole block into mix->wave and
+   apply the wave resets from sync, replaces cyd_cycle_wave_fm() when the channel has no FM */
+
+static void cyd_render_waves(CydEngine *cyd, CydMixBuffer *mix, CydChannel *chn, int frames)
+{
+	for (int f = 0 ; f < frames ; )
+	{
+		int n = 1;
+
+		while (f + n < frames && !cyd_sync_triggered(cyd, chn, f + n - 1))
+			++n;
+
+		if ((chn->flags & CYD_CHN_ENABLE_WAVE) && chn->wave_entry)
+		{
+			for (int s = 0 ; s < CYD_SUB_OSCS ; ++s)
+				cyd_wave_render(&chn->subosc[s].wave, chn->wave_entry, mix->wave[s] + f, n);
+		}
+
+		if (cyd_sync_triggered(cyd, chn, f + n - 1))
+			cyd_sync_wave(chn);
+
+		f += n;
+	}
+}
+
+
+static Sint32 cyd_ring_modulate(CydEngine *cyd, CydChannel *chn, int frame, Sint32 s)
+{
+	if (chn->flags & CYD_CHN_ENABLE_RING_MODULATION)
+		return s * (cyd->block->source[chn->ring_mod][frame] + (WAVE_AMP / 2)) / WAVE_AMP;
+	else
+		return s;
+}
+
+
+static void cyd_pan_output(CydMixBuffer *mix, const CydChannel *chn, int frame, Sint32 o);
+
+
+/* Add the enveloped channel output o to the buses, filtered channels are collected for cyd_filter_channels() */
+
+static void cyd_mix_output(CydEngine *cyd, CydMixBuffer *mix, CydChannel *chn, int frame, Sint32 o)
+{
+#ifndef CYD_DISABLE_FILTER
+	if (chn->flags & CYD_CHN_ENABLE_FILTER)
+	{
+		// The gate only closes during a block so the filtered frames are always at the start of the block
+		const int idx = chn - cyd->channel;
+		cyd->block->filter[idx][frame] = o;
+		cyd->block->filter_frames[idx] = frame + 1;
+		return;
+	}
+#endif
+
+	cyd_pan_output(mix, chn, frame, o);
+}
+
+
+static void cyd_pan_output(CydMixBuffer *mix, const CydChannel *chn, int frame, Sint32 o)
+{
 #ifdef STEREOOUTPUT
-				fx_l[chn->fx_bus] += ol;
-				fx_r[chn->fx_bus] += or;
+	Sint32 ol = o * chn->gain_left / CYD_STEREO_GAIN, or = o * chn->gain_right / CYD_STEREO_GAIN;
+
+	if (chn->flags & CYD_CHN_ENABLE_FX)
+	{
+		mix->fx_l[chn->fx_bus][frame] += ol;
+		mix->fx_r[chn->fx_bus][frame] += or;
+	}
+	else
+	{
+		mix->out_l[frame] += ol;
+		mix->out_r[frame] += or;
+	}
 #else
-				fx_input[chn->fx_bus] += o;
+	if (chn->flags & CYD_CHN_ENABLE_FX)
+		mix->fx_input[chn->fx_bus][frame] += o;
+	else
+		mix->out[frame] += o;
+#endif
+}
+
+
+static void cyd_mix_channel(CydEngine *cyd, CydMixBuffer *mix, CydChannel *chn, Sint32 (*wave)[CYD_BLOCK_SIZE], int frame, Sint32 s)
+{
+	cyd_mix_output(cyd, mix, chn, frame, cyd_env_output(cyd, chn->flags, &chn->adsr, cyd_ring_modulate(cyd, chn, frame, s)) + cyd_wave_output(cyd, chn, wave, frame, CYD_CHN_WAVE_OVERRIDE_ENV));
+}
+
+
+/* Step an idle channel through the block without producing any output. Oscillator, noise, LFSR,
+   wavetable and FM state still advance exactly as if the channel was rendered so the next note
+   starts from the correct phase */
+
+static void cyd_skip_channel(CydEngine *cyd, int idx, int frames)
+{
+	CydChannel *chn = &cyd->channel[idx];
+	Uint8 *sync = cyd->block->sync[idx];
+
+	for (int f = 0 ; f < frames ; ++f)
+	{
+		chn->sync_bit = 0;
+
+		for (int i = 0 ; i < (1 << cyd->oversample) ; ++i)
+		{
+			cyd_advance_oscillators(cyd, chn);
+
+#ifndef CYD_DISABLE_FM
+			cydfm_cycle_oversample(cyd, &chn->fm);
 #endif
+		}
+
+		sync[f] = chn->sync_bit != 0;
+
+		cyd_cycle_channel(cyd, chn);
+		cyd_sync_channel(cyd, chn, f);
+	}
+}
+
+
+/* Advance only the envelopes by frames samples so that the gates turn off when they would have during
+   playback, used for simulating a song quickly. Oscillators, filters and effects are left as they are */
+
+void cyd_advance_envelopes(CydEngine *cyd, int frames)
+{
+	for (int i = 0 ; i < cyd->n_channels ; ++i)
+	{
+		CydChannel *chn = &cyd->channel[i];
+
+#ifndef CYD_DISABLE_ENVELOPE
+		if (!(chn->flags & CYD_CHN_ENABLE_YM_ENV))
+		{
+			chn->flags = cyd_advance_adsr(cyd, chn->flags, &chn->adsr, frames);
+		}
+		else
+#endif
+		{
+			for (int f = 0 ; f < frames ; ++f)
+				chn->flags = cyd_cycle_adsr(cyd, chn->flags, chn->ym_env_shape, &chn->adsr);
+		}
+
+#if !defined(CYD_DISABLE_FM) && !defined(CYD_DISABLE_ENVELOPE)
+		if (chn->flags & CYD_CHN_ENABLE_FM)
+			cyd_advance_adsr(cyd, 0, &chn->fm.adsr, frames);
+#endif
+	}
+}
+
+
+#ifndef CYD_DISABLE_ENVELOPE
+/* The envelope is advanced CYD_ENV_CONTROL_RATE samples at a time and the gain is ramped linearly in between,
+   otherwise the same as the loops in cyd_render_channel() */
+
+static void cyd_render_channel_control_rate(CydEngine *cyd, CydMixBuffer *mix, int idx, int frames, int per_frame)
+{
+	CydChannel *chn = &cyd->channel[idx];
+	Sint32 *source = cyd->block->source[idx];
+	Uint8 *sync = cyd->block->sync[idx];
+	Sint32 (*wave)[CYD_BLOCK_SIZE] = per_frame ? NULL : mix->wave;
+
+	if (!per_frame)
+		cyd_render_waves(cyd, mix, chn, frames);
+
+	for (int f = 0 ; f < frames ; )
+	{
+		const int n = my_min(CYD_ENV_CONTROL_RATE, frames - f);
+		const Uint32 gate = chn->flags & CYD_CHN_ENABLE_GATE;
+		const Sint32 gain = cyd_env_gain(cyd, &chn->adsr);
+
+		chn->flags = cyd_advance_adsr(cyd, chn->flags, &chn->adsr, n);
+
+		const Sint32 delta = cyd_env_gain(cyd, &chn->adsr) - gain;
+
+		for (int i = 0 ; i < n ; ++i, ++f)
+		{
+			if (per_frame)
+			{
+				source[f] = cyd_channel_source(cyd, chn, NULL, f, cyd_output_channel(cyd, chn));
+				sync[f] = chn->sync_bit != 0;
 			}
 			else
 			{
+				source[f] = cyd_channel_source(cyd, chn, wave, f, source[f]);
+			}
+
+			if (gate)
+			{
+				const Sint32 g = gain + delta * i / n;
+				cyd_mix_output(cyd, mix, chn, f, ((Sint64)cyd_ring_modulate(cyd, chn, f, source[f]) * g / 65536) * (Sint32)(chn->adsr.volume) / MAX_VOLUME
+					+ cyd_wave_output(cyd, chn, wave, f, CYD_CHN_WAVE_OVERRIDE_ENV));
+			}
+
+			if (per_frame)
+			{
+				cyd_cycle_wave_fm(cyd, chn);
+				cyd_sync_channel(cyd, chn, f);
+			}
+		}
+	}
+}
+#endif
+
+
+static void cyd_render_channel_frames(CydEngine *cyd, CydMixBuffer *mix, int idx, int frames, int per_frame)
+{
+	CydChannel *chn = &cyd->channel[idx];
+	Sint32 *source = cyd->block->source[idx];
+
+#ifndef CYD_DISABLE_ENVELOPE
+	if ((cyd->flags & CYD_CONTROL_RATE_ENVELOPE) && !(chn->flags & CYD_CHN_ENABLE_YM_ENV))
+	{
+		cyd_render_channel_control_rate(cyd, mix, idx, frames, per_frame);
+		return;
+	}
+#endif
+
+	if (per_frame)
+	{
+		Uint8 *sync = cyd->block->sync[idx];
+
+		for (int f = 0 ; f < frames ; ++f)
+		{
+			source[f] = cyd_channel_source(cyd, chn, NULL, f, cyd_output_channel(cyd, chn));
+			sync[f] = chn->sync_bit != 0;
+
+			if (chn->flags & CYD_CHN_ENABLE_GATE)
+				cyd_mix_channel(cyd, mix, chn, NULL, f, source[f]);
+
+			cyd_cycle_channel(cyd, chn);
+			cyd_sync_channel(cyd, chn, f);
+		}
+
+		return;
+	}
+
+	// No FM here so the wavetable voices can be rendered and cycled for the whole block first
+
+	cyd_render_waves(cyd, mix, chn, frames);
+
+	for (int f = 0 ; f < frames ; ++f)
+	{
+		source[f] = cyd_channel_source(cyd, chn, mix->wave, f, source[f]);
+
+		if (chn->flags & CYD_CHN_ENABLE_GATE)
+			cyd_mix_channel(cyd, mix, chn, mix->wave, f, source[f]);
+
+		chn->flags = cyd_cycle_adsr(cyd, chn->flags, chn->ym_env_shape, &chn->adsr);
+	}
+}
+
+
+#ifdef CYD_PROFILE
+static int cyd_profile_stage(const CydChannel *chn, int per_frame)
+{
+#ifndef CYD_DISABLE_FM
+	if (chn->flags & CYD_CHN_ENABLE_FM)
+		return CYD_PROFILE_FM;
+#endif
+
+	if (per_frame)
+		return CYD_PROFILE_OSCILLATORS;
+	else if (chn->flags & CYD_CHN_ENABLE_WAVE)
+		return CYD_PROFILE_WAVETABLE;
+	else
+		return CYD_PROFILE_MIX;
+}
+#endif
+
+
+/* Render a channel through the whole block, sources for sync and ring modulation must be rendered first */
+
+static void cyd_render_channel(CydEngine *cyd, CydMixBuffer *mix, int idx, int frames)
+{
+	CydChannel *chn = &cyd->channel[idx];
+
+	if (!(cyd->block->active & ((Uint32)1 << idx)))
+	{
+		cyd_skip_channel(cyd, idx, frames);
+		return;
+	}
+
+	const int per_frame = cyd_channel_is_bandlimited(cyd, chn)
+#ifndef CYD_DISABLE_FM
+		|| (chn->flags & CYD_CHN_ENABLE_FM)
+#endif
+		;
+
+	if (!per_frame)
+	{
+		CYD_PROFILE_START(osc_start);
+		cyd_render_oscillators(cyd, mix, idx, frames, cyd->block->source[idx]);
+		CYD_PROFILE_STOP(osc_start, cyd->profile_channel[idx][CYD_PROFILE_OSCILLATORS]);
+	}
+
+	CYD_PROFILE_START(start);
+	cyd_render_channel_frames(cyd, mix, idx, frames, per_frame);
+	CYD_PROFILE_STOP(start, cyd->profile_channel[idx][cyd_profile_stage(chn, per_frame)]);
+}
+
+
+/* Fallback for circular sync/ring modulation setups, renders all channels one sample at a time */
+
+static void cyd_render_channels_interleaved(CydEngine *cyd, int frames)
+{
+	CydBlock *block = cyd->block;
+
+	for (int f = 0 ; f < frames ; ++f)
+	{
+		for (int i = 0 ; i < cyd->n_channels ; ++i)
+		{
+			block->source[i][f] = cyd_channel_source(cyd, &cyd->channel[i], NULL, f, cyd_output_channel(cyd, &cyd->channel[i]));
+			block->sync[i][f] = cyd->channel[i].sync_bit != 0;
+		}
+
+		for (int i = 0 ; i < cyd->n_channels ; ++i)
+		{
+			CydChannel *chn = &cyd->channel[i];
+
+			if (chn->flags & CYD_CHN_ENABLE_GATE)
+				cyd_mix_channel(cyd, &block->mix, chn, NULL, f, block->source[i][f]);
+
+			cyd_cycle_channel(cyd, chn);
+		}
+
+		for (int i = 0 ; i < cyd->n_channels ; ++i)
+		{
+			cyd_sync_channel(cyd, &cyd->channel[i], f);
+		}
+	}
+}
+
+
+static int cyd_channel_dependency(const CydEngine *cyd, const CydChannel *chn, int idx, int dep)
+{
+	Uint32 flag = dep ? CYD_CHN_ENABLE_SYNC : CYD_CHN_ENABLE_RING_MODULATION;
+	int src = dep ? chn->sync_source : chn->ring_mod;
+
+	if ((chn->flags & flag) && src != idx && src < cyd->n_channels)
+		return src;
+
+	return -1;
+}
+
+
+static int cyd_visit_channel(const CydEngine *cyd, int idx, Uint8 *state, int *order, int *n)
+{
+	if (state[idx] == 2) return 1;
+	if (state[idx] == 1) return 0; // circular dependency
+
+	state[idx] = 1;
+
+	for (int dep = 0 ; dep < 2 ; ++dep)
+	{
+		int src = cyd_channel_dependency(cyd, &cyd->channel[idx], idx, dep);
+
+		if (src != -1 && !cyd_visit_channel(cyd, src, state, order, n))
+			return 0;
+	}
+
+	state[idx] = 2;
+	order[(*n)++] = idx;
+
+	return 1;
+}
+
+
+/* Order channels so that sync and ring modulation sources come before the channels using them */
+
+static int cyd_order_channels(const CydEngine *cyd, int *order)
+{
+	Uint8 state[CYD_MAX_CHANNELS] = {0};
+	int n = 0;
+
+	for (int i = 0 ; i < cyd->n_channels ; ++i)
+	{
+		if (!cyd_visit_channel(cyd, i, state, order, &n))
+			return 0;
+	}
+
+	return 1;
+}
+
+
+/* Group the ordered channels by dependency depth, channels on the same level can be rendered in parallel */
+
+static void cyd_level_channels(const CydEngine *cyd, CydBlock *block, const int *order)
+{
+	int level[CYD_MAX_CHANNELS], count[CYD_MAX_CHANNELS + 1] = {0};
+
+	block->n_levels = 0;
+
+	for (int i = 0 ; i < cyd->n_channels ; ++i)
+	{
+		const int idx = order[i];
+
+		level[idx] = 0;
+
+		for (int dep = 0 ; dep < 2 ; ++dep)
+		{
+			int src = cyd_channel_dependency(cyd, &cyd->channel[idx], idx, dep);
+
+			if (src != -1)
+				level[idx] = my_max(level[idx], level[src] + 1);
+		}
+
+		++count[level[idx]];
+		block->n_levels = my_max(block->n_levels, level[idx] + 1);
+	}
+
+	block->level_start[0] = 0;
+
+	for (int l = 0 ; l < block->n_levels ; ++l)
+		block->level_start[l + 1] = block->level_start[l] + count[l];
+
+	for (int l = 0 ; l < block->n_levels ; ++l)
+		count[l] = block->level_start[l];
+
+	for (int i = 0 ; i < cyd->n_channels ; ++i)
+		block->order[count[level[order[i]]]++] = order[i];
+}
+
+
+static void cyd_clear_mix(CydMixBuffer *mix, int frames)
+{
 #ifdef STEREOOUTPUT
-				*left += ol;
-				*right += or;
+	memset(mix->out_l, 0, sizeof(mix->out_l[0]) * frames);
+	memset(mix->out_r, 0, sizeof(mix->out_r[0]) * frames);
+
+	for (int i = 0 ; i < CYD_MAX_FX_CHANNELS ; ++i)
+	{
+		memset(mix->fx_l[i], 0, sizeof(mix->fx_l[i][0]) * frames);
+		memset(mix->fx_r[i], 0, sizeof(mix->fx_r[i][0]) * frames);
+	}
 #else
-				v += o;
+	memset(mix->out, 0, sizeof(mix->out[0]) * frames);
+
+	for (int i = 0 ; i < CYD_MAX_FX_CHANNELS ; ++i)
+		memset(mix->fx_input[i], 0, sizeof(mix->fx_input[i][0]) * frames);
+#endif
+}
+
+
+static void cyd_add_mix(CydMixBuffer *dest, const CydMixBuffer *src, int frames)
+{
+	for (int f = 0 ; f < frames ; ++f)
+	{
+#ifdef STEREOOUTPUT
+		dest->out_l[f] += src->out_l[f];
+		dest->out_r[f] += src->out_r[f];
+#else
+		dest->out[f] += src->out[f];
 #endif
-			}
-		}
 	}
 
 	for (int i = 0 ; i < CYD_MAX_FX_CHANNELS ; ++i)
 	{
+		for (int f = 0 ; f < frames ; ++f)
+		{
 #ifdef STEREOOUTPUT
-		Sint32 l, r;
-		cydfx_output(&cyd->fx[i], fx_l[i], fx_r[i], &l, &r);
-		*left += l;
-		*right += r;
+			dest->fx_l[i][f] += src->fx_l[i][f];
+			dest->fx_r[i][f] += src->fx_r[i][f];
 #else
-		v += cydfx_output(&cyd->fx[i], fx_input[i]);
+			dest->fx_input[i][f] += src->fx_input[i][f];
 #endif
+		}
+	}
+}
+
+
+/* Render every (n_workers + 1)th channel of the current level starting from thread, thread 0 is the audio thread */
+
+static void cyd_render_level(CydEngine *cyd, CydMixBuffer *mix, int thread)
+{
+	CydBlock *block = cyd->block;
+
+	for (int i = block->level_start[cyd->level] + thread ; i < block->level_start[cyd->level + 1] ; i += cyd->n_workers + 1)
+		cyd_render_channel(cyd, mix, block->order[i], block->frames);
+}
+
+
+static int cyd_worker_thread(void *data)
+{
+	CydWorker *worker = data;
+
+	for (;;)
+	{
+		SDL_SemWait(worker->start);
+
+		if (worker->quit)
+			break;
+
+		cyd_render_level(worker->cyd, &worker->mix, worker->index + 1);
+
+		SDL_SemPost(worker->done);
+	}
+
+	return 0;
+}
+
+
+static void cyd_render_channels_parallel(CydEngine *cyd, const int *order, int frames)
+{
+	CydBlock *block = cyd->block;
+
+	cyd_level_channels(cyd, block, order);
+	block->frames = frames;
+
+	for (int w = 0 ; w < cyd->n_workers ; ++w)
+		cyd_clear_mix(&cyd->workers[w].mix, frames);
+
+	for (cyd->level = 0 ; cyd->level < block->n_levels ; ++cyd->level)
+	{
+		for (int w = 0 ; w < cyd->n_workers ; ++w)
+			SDL_SemPost(cyd->workers[w].start);
+
+		cyd_render_level(cyd, &block->mix, 0);
+
+		for (int w = 0 ; w < cyd->n_workers ; ++w)
+			SDL_SemWait(cyd->workers[w].done);
 	}
 
-#ifndef STEREOOUTPUT
-	return v;
+	// Integer sums so the result does not depend on which thread rendered what, the order is fixed anyway
+
+	for (int w = 0 ; w < cyd->n_workers ; ++w)
+		cyd_add_mix(&block->mix, &cyd->workers[w].mix, frames);
+}
+
+
+void cyd_set_threads(CydEngine *cyd, int threads)
+{
+	threads = my_max(1, my_min(CYD_MAX_THREADS, threads));
+
+	if (threads - 1 == cyd->n_workers)
+		return;
+
+	cyd_lock(cyd, 1);
+
+	for (int w = 0 ; w < cyd->n_workers ; ++w)
+	{
+		cyd->workers[w].quit = 1;
+		SDL_SemPost(cyd->workers[w].start);
+		SDL_WaitThread(cyd->workers[w].thread, NULL);
+		SDL_DestroySemaphore(cyd->workers[w].start);
+		SDL_DestroySemaphore(cyd->workers[w].done);
+	}
+
+	free(cyd->workers);
+	cyd->workers = NULL;
+	cyd->n_workers = 0;
+
+	if (threads > 1)
+	{
+		cyd->workers = calloc(threads - 1, sizeof(*cyd->workers));
+
+		for (int w = 0 ; w < threads - 1 ; ++w)
+		{
+			CydWorker *worker = &cyd->workers[w];
+
+			worker->cyd = cyd;
+			worker->index = w;
+			worker->start = SDL_CreateSemaphore(0);
+			worker->done = SDL_CreateSemaphore(0);
+#if SDL_VERSION_ATLEAST(1,3,0)
+			worker->thread = SDL_CreateThread(cyd_worker_thread, "Cyd worker", worker);
+#else
+			worker->thread = SDL_CreateThread(cyd_worker_thread, worker);
 #endif
+
+			if (!worker->thread)
+			{
+				warning("Could not create render thread: %s", SDL_GetError());
+				SDL_DestroySemaphore(worker->start);
+				SDL_DestroySemaphore(worker->done);
+				break;
+			}
+
+			++cyd->n_workers;
+		}
+	}
+
+	debug("Rendering with %d threads", cyd->n_workers + 1);
+
+	cyd_lock(cyd, 0);
 }
 
 
-static void cyd_cycle(CydEngine *cyd)
+/* A channel needs to be rendered if its gate is on or if its output is used for ring modulation,
+   the gate can only be turned on by the tick callback so this holds for the whole block */
+
+static Uint32 cyd_active_channels(const CydEngine *cyd)
 {
+	Uint32 active = 0;
+
 	for (int i = 0 ; i < cyd->n_channels ; ++i)
 	{
-		cyd_cycle_channel(cyd, &cyd->channel[i]);
+		const CydChannel *chn = &cyd->channel[i];
+
+		if (chn->flags & CYD_CHN_ENABLE_GATE)
+		{
+			active |= (Uint32)1 << i;
+
+			if (chn->flags & CYD_CHN_ENABLE_RING_MODULATION)
+				active |= (Uint32)1 << chn->ring_mod;
+		}
 	}
 
+	return active;
+}
+
+
+#ifndef CYD_DISABLE_FILTER
+/* Filter the channels collected by cyd_mix_output() CYDFLT_BANK_LANES at a time and mix them */
+
+static void cyd_filter_channels(CydEngine *cyd)
+{
+	CydBlock *block = cyd->block;
+	CydFilter *flt[CYDFLT_BANK_LANES];
+	Sint32 *buffer[CYDFLT_BANK_LANES];
+	Uint8 type[CYDFLT_BANK_LANES];
+	int frames[CYDFLT_BANK_LANES], channel[CYDFLT_BANK_LANES];
+	int lanes = 0;
+
 	for (int i = 0 ; i < cyd->n_channels ; ++i)
 	{
-		cyd_sync_channel(cyd, &cyd->channel[i]);
+		if (block->filter_frames[i] > 0)
+		{
+			CydChannel *chn = &cyd->channel[i];
+			flt[lanes] = &chn->flt;
+			buffer[lanes] = block->filter[i];
+			type[lanes] = chn->flttype;
+			frames[lanes] = block->filter_frames[i];
+			channel[lanes] = i;
+			++lanes;
+		}
+
+		if (lanes == CYDFLT_BANK_LANES || (lanes > 0 && i == cyd->n_channels - 1))
+		{
+			cydflt_cycle_bank(flt, type, buffer, frames, lanes);
+
+			for (int l = 0 ; l < lanes ; ++l)
+			{
+				for (int f = 0 ; f < frames[l] ; ++f)
+					cyd_pan_output(&block->mix, &cyd->channel[channel[l]], f, buffer[l][f]);
+
+				block->filter_frames[channel[l]] = 0;
+			}
+
+			lanes = 0;
+		}
+	}
+}
+#endif
+
+
+static void cyd_render_block(CydEngine *cyd, int frames)
+{
+	CydBlock *block = cyd->block;
+	int order[CYD_MAX_CHANNELS];
+
+	cyd_clear_mix(&block->mix, frames);
+
+	block->active = cyd_active_channels(cyd);
+
+	if (cyd_order_channels(cyd, order))
+	{
+		if (cyd->n_workers > 0)
+		{
+			cyd_render_channels_parallel(cyd, order, frames);
+		}
+		else
+		{
+			for (int i = 0 ; i < cyd->n_channels ; ++i)
+				cyd_render_channel(cyd, &block->mix, order[i], frames);
+		}
+	}
+	else
+	{
+		cyd_render_channels_interleaved(cyd, frames);
+	}
+
+#ifndef CYD_DISABLE_FILTER
+	CYD_PROFILE_START(filter_start);
+	cyd_filter_channels(cyd);
+	CYD_PROFILE_STOP(filter_start, cyd->profile.stage[CYD_PROFILE_FILTER]);
+#endif
+
+	CYD_PROFILE_START(fx_start);
+
+	for (int i = 0 ; i < CYD_MAX_FX_CHANNELS ; ++i)
+	{
+#ifdef STEREOOUTPUT
+		cydfx_output_block(&cyd->fx[i], block->mix.fx_l[i], block->mix.fx_r[i], block->mix.out_l, block->mix.out_r, frames);
+#else
+		cydfx_output_block(&cyd->fx[i], block->mix.fx_input[i], block->mix.out, frames);
+#endif
+	}
+
+	CYD_PROFILE_STOP(fx_start, cyd->profile.stage[CYD_PROFILE_FX]);
+
+#ifdef CYD_PROFILE
+	cyd->profile.frames += frames;
+#endif
+}
+
+
+/* Queue a command for the audio thread without taking the lock. Only one thread may post commands.
+   Returns 0 if the queue is full */
+
+int cyd_post_command(CydEngine *cyd, const CydCommand *command)
+{
+	CydCommandQueue *q = cyd->commands;
+	const Uint32 head = q->head;
+
+	if (head - cyd_load_acquire(&q->tail) >= CYD_COMMAND_QUEUE_SIZE)
+		return 0;
+
+	q->command[head & (CYD_COMMAND_QUEUE_SIZE - 1)] = *command;
+	cyd_store_release(&q->head, head + 1);
+
+	return 1;
+}
+
+
+static void cyd_run_commands(CydEngine *cyd)
+{
+	CydCommandQueue *q = cyd->commands;
+	const Uint32 head = cyd_load_acquire(&q->head);
+	Uint32 tail = q->tail;
+
+	while (tail != head)
+	{
+		const CydCommand *command = &q->command[tail & (CYD_COMMAND_QUEUE_SIZE - 1)];
+		command->execute(command->context, command);
+		++tail;
 	}
+
+	cyd_store_release(&q->tail, tail);
+}
+
+
+/* Run the tick callback if it is due, returns the amount of samples until the next tick or 0 if the callback wants to stop */
+
+static int cyd_run_callback(CydEngine *cyd, int frames)
+{
+	if (cyd->callback)
+	{
+		if (cyd->callback_counter-- == 0)
+		{
+			cyd->callback_counter = cyd->callback_period-1;
+
+			CYD_PROFILE_START(start);
+			const int result = cyd->callback(cyd->callback_parameter);
+			CYD_PROFILE_STOP(start, cyd->profile.stage[CYD_PROFILE_CALLBACK]);
+
+			if (!result)
+				return 0;
+		}
+
+		frames = my_min(frames, cyd->callback_counter + 1);
+		cyd->callback_counter -= frames - 1;
+	}
+
+	return frames;
 }
 
 
@@ -707,7 +1722,7 @@ void cyd_output_buffer(int chan, void *_stream, int len, void *udata)
 	Sint16 * stream = (void*)_stream;
 	cyd->samples_output = 0;
 
-	for (int i = 0 ; i < len ; i += sizeof(Sint16), ++stream, ++cyd->samples_output)
+	for (int i = 0 ; i < len ; )
 	{
 
 #ifndef USENATIVEAPIS
@@ -740,39 +1755,40 @@ void cyd_output_buffer(int chan, void *_stream, int len, void *udata)
 
 		cyd_lock(cyd, 1);
 
-		for (int g = 0 ; g < BUFFER_GRANULARITY && i < len ; i += sizeof(Sint16)*2, stream += 2, ++cyd->samples_output)
+		for (int g = 0 ; g < BUFFER_GRANULARITY && i < len ; )
 		{
+			cyd_run_commands(cyd);
 
-			if (cyd->callback && cyd->callback_counter-- == 0)
+			int frames = cyd_run_callback(cyd, my_min(my_min(CYD_BLOCK_SIZE, BUFFER_GRANULARITY - g), (len - i + sizeof(Sint16) * 2 - 1) / (sizeof(Sint16) * 2)));
+
+			if (frames == 0)
 			{
-				cyd->callback_counter = cyd->callback_period-1;
-				if (!cyd->callback(cyd->callback_parameter))
-				{
-					cyd_lock(cyd, 0);
-					return;
-				}
+				cyd_lock(cyd, 0);
+				return;
 			}
 
+			cyd_render_block(cyd, frames);
+			g += frames;
+
+			for (int f = 0 ; f < frames ; ++f, i += sizeof(Sint16)*2, stream += 2, ++cyd->samples_output)
+			{
 #ifdef STEREOOUTPUT
-			Sint32 output, left, right;
-			cyd_output(cyd, &left, &right);
-			output = (left + right) / 2;
+				Sint32 output = (cyd->block->mix.out_l[f] + cyd->block->mix.out_r[f]) / 2;
 #else
-			Sint32 output = cyd_output(cyd);
+				Sint32 output = cyd->block->mix.out[f];
 #endif
 
 #ifdef NOSDL_MIXER
-			Sint32 o = (output * PRE_GAIN) / PRE_GAIN_DIVISOR;
+				Sint32 o = (output * PRE_GAIN) / PRE_GAIN_DIVISOR;
 #else
-			Sint32 o = (Sint32)*(Sint16*)stream + (output * PRE_GAIN) / PRE_GAIN_DIVISOR;
+				Sint32 o = (Sint32)*(Sint16*)stream + (output * PRE_GAIN) / PRE_GAIN_DIVISOR;
 #endif
 
-			if (o < -32768) o = -32768;
-			else if (o > 32767) o = 32767;
+				if (o < -32768) o = -32768;
+				else if (o > 32767) o = 32767;
 
-			*(Sint16*)stream = o;
-
-			cyd_cycle(cyd);
+				*(Sint16*)stream = o;
+			}
 		}
 
 		cyd_lock(cyd, 0);
@@ -824,70 +1840,180 @@ void cyd_output_buffer_stereo(int chan, void *_stream, int len, void *udata)
 
 		cyd_lock(cyd, 1);
 
-		for (int g = 0 ; g < BUFFER_GRANULARITY && i < len ; i += sizeof(Sint16)*2, stream += 2, ++cyd->samples_output)
+		for (int g = 0 ; g < BUFFER_GRANULARITY && i < len ; )
 		{
+			cyd_run_commands(cyd);
 
-			if (cyd->callback && cyd->callback_counter-- == 0)
+			int frames = cyd_run_callback(cyd, my_min(my_min(CYD_BLOCK_SIZE, BUFFER_GRANULARITY - g), (len - i + sizeof(Sint16) * 2 - 1) / (sizeof(Sint16) * 2)));
+
+			if (frames == 0)
 			{
-				cyd->callback_counter = cyd->callback_period-1;
-				if (!cyd->callback(cyd->callback_parameter))
-				{
-					cyd_lock(cyd, 0);
-					return;
-				}
+				cyd_lock(cyd, 0);
+				return;
 			}
 
-			Sint32 left, right;
+			cyd_render_block(cyd, frames);
+			g += frames;
+
+			for (int f = 0 ; f < frames ; ++f, i += sizeof(Sint16)*2, stream += 2, ++cyd->samples_output)
+			{
 #ifdef STEREOOUTPUT
-			cyd_output(cyd, &left, &right);
+				Sint32 left = cyd->block->mix.out_l[f], right = cyd->block->mix.out_r[f];
 #else
-			left = right = cyd_output(cyd);
+				Sint32 left = cyd->block->mix.out[f], right = cyd->block->mix.out[f];
 #endif
 
 #ifdef NOSDL_MIXER
-			Sint32 o1 = (left * PRE_GAIN) / PRE_GAIN_DIVISOR;
+				Sint32 o1 = (left * PRE_GAIN) / PRE_GAIN_DIVISOR;
 #else
-			Sint32 o1 = (Sint32)*(Sint16*)stream + (left * PRE_GAIN) / PRE_GAIN_DIVISOR;
+				Sint32 o1 = (Sint32)*(Sint16*)stream + (left * PRE_GAIN) / PRE_GAIN_DIVISOR;
 #endif
 
-			if (o1 < -32768)
-			{
-				o1 = -32768;
-				cyd->flags |= CYD_CLIPPING;
-			}
-			else if (o1 > 32767)
-			{
-				o1 = 32767;
-				cyd->flags |= CYD_CLIPPING;
-			}
+				if (o1 < -32768)
+				{
+					o1 = -32768;
+					cyd->flags |= CYD_CLIPPING;
+				}
+				else if (o1 > 32767)
+				{
+					o1 = 32767;
+					cyd->flags |= CYD_CLIPPING;
+				}
 
-			*(Sint16*)stream = o1;
+				*(Sint16*)stream = o1;
 
 #ifdef NOSDL_MIXER
-			Sint32 o2 = (right * PRE_GAIN) / PRE_GAIN_DIVISOR;
+				Sint32 o2 = (right * PRE_GAIN) / PRE_GAIN_DIVISOR;
 #else
-			Sint32 o2 = (Sint32)*((Sint16*)stream + 1) + (right * PRE_GAIN) / PRE_GAIN_DIVISOR;
+				Sint32 o2 = (Sint32)*((Sint16*)stream + 1) + (right * PRE_GAIN) / PRE_GAIN_DIVISOR;
 #endif
 
-			if (o2 < -32768)
+				if (o2 < -32768)
+				{
+					o2 = -32768;
+					cyd->flags |= CYD_CLIPPING;
+				}
+				else if (o2 > 32767)
+				{
+					o2 = 32767;
+					cyd->flags |= CYD_CLIPPING;
+				}
+
+				*((Sint16*)stream + 1) = o2;
+
+				++cyd->samples_played;
+			}
+		}
+
+		cyd_lock(cyd, 0);
+	}
+}
+
+
+/* Render into separate left and right buffers, overwriting them. Either the Sint32 or the float pair is used.
+   Nothing is clamped, full scale is the same as with the Sint16 output. Returns the number of frames rendered */
+
+static int cyd_output_planar(CydEngine *cyd, Sint32 *left, Sint32 *right, float *left_f, float *right_f, int frames)
+{
+	int i = 0;
+
+	cyd->samples_output = 0;
+
+	while (i < frames)
+	{
+#ifndef USENATIVEAPIS
+
+#ifndef USESDLMUTEXES
+#ifdef DEBUG
+		Uint32 waittime = SDL_GetTicks();
+#endif
+		while (cyd->lock_request)
+		{
+#ifdef DEBUG
+			if (SDL_GetTicks() - waittime > 5000)
 			{
-				o2 = -32768;
-				cyd->flags |= CYD_CLIPPING;
+				warning("Deadlock from cyd_output_planar");
+				waittime = SDL_GetTicks();
 			}
-			else if (o2 > 32767)
+#endif
+			SDL_Delay(1);
+		}
+#endif
+
+#endif
+
+		if (cyd->flags & CYD_PAUSED)
+		{
+			const int n = my_min(BUFFER_GRANULARITY, frames - i);
+
+			if (left)
 			{
-				o2 = 32767;
-				cyd->flags |= CYD_CLIPPING;
+				memset(&left[i], 0, sizeof(left[0]) * n);
+				memset(&right[i], 0, sizeof(right[0]) * n);
+			}
+			else
+			{
+				memset(&left_f[i], 0, sizeof(left_f[0]) * n);
+				memset(&right_f[i], 0, sizeof(right_f[0]) * n);
 			}
 
-			*((Sint16*)stream + 1) = o2;
+			i += n;
+			continue;
+		}
+
+		cyd_lock(cyd, 1);
+
+		for (int g = 0, n = 0 ; g < BUFFER_GRANULARITY && i < frames ; g += n)
+		{
+			cyd_run_commands(cyd);
+
+			n = cyd_run_callback(cyd, my_min(my_min(CYD_BLOCK_SIZE, BUFFER_GRANULARITY - g), frames - i));
+
+			if (n == 0)
+			{
+				cyd_lock(cyd, 0);
+				return i;
+			}
+
+			cyd_render_block(cyd, n);
+
+			for (int f = 0 ; f < n ; ++f, ++i, ++cyd->samples_output, ++cyd->samples_played)
+			{
+#ifdef STEREOOUTPUT
+				Sint32 l = cyd->block->mix.out_l[f] * PRE_GAIN / PRE_GAIN_DIVISOR, r = cyd->block->mix.out_r[f] * PRE_GAIN / PRE_GAIN_DIVISOR;
+#else
+				Sint32 l = cyd->block->mix.out[f] * PRE_GAIN / PRE_GAIN_DIVISOR, r = l;
+#endif
 
-			cyd_cycle(cyd);
-			++cyd->samples_played;
+				if (left)
+				{
+					left[i] = l;
+					right[i] = r;
+				}
+				else
+				{
+					left_f[i] = l * (1.0f / 32768);
+					right_f[i] = r * (1.0f / 32768);
+				}
+			}
 		}
 
 		cyd_lock(cyd, 0);
 	}
+
+	return i;
+}
+
+
+int cyd_output_buffer_planar(CydEngine *cyd, Sint32 *left, Sint32 *right, int frames)
+{
+	return cyd_output_planar(cyd, left, right, NULL, NULL, frames);
+}
+
+
+int cyd_output_buffer_planar_float(CydEngine *cyd, float *left, float *right, int frames)
+{
+	return cyd_output_planar(cyd, NULL, NULL, left, right, frames);
 }
 
 
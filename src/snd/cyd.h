@@ -133,6 +133,101 @@ enum
 
 #define CYD_NUM_LFSR 16
 
+/* Scratch buffers for rendering CYD_BLOCK_SIZE samples at a time */
+
+/* Bus sums and oscillator scratch, each render thread has its own */
+typedef struct
+{
+#ifdef STEREOOUTPUT
+	Sint32 fx_l[CYD_MAX_FX_CHANNELS][CYD_BLOCK_SIZE], fx_r[CYD_MAX_FX_CHANNELS][CYD_BLOCK_SIZE];
+	Sint32 out_l[CYD_BLOCK_SIZE], out_r[CYD_BLOCK_SIZE];
+#else
+	Sint32 fx_input[CYD_MAX_FX_CHANNELS][CYD_BLOCK_SIZE];
+	Sint32 out[CYD_BLOCK_SIZE];
+#endif
+	Uint32 osc_acc[CYD_SUB_OSCS][CYD_OSC_LANES], osc_random[CYD_SUB_OSCS][CYD_OSC_LANES], osc_lfsr[CYD_SUB_OSCS][CYD_OSC_LANES]; // oscillator state per oversampled step
+	Sint32 osc_output[CYD_OSC_LANES];
+	Sint32 wave[CYD_SUB_OSCS][CYD_BLOCK_SIZE]; // wavetable output per sub-oscillator
+} CydMixBuffer;
+
+typedef struct
+{
+	Sint32 source[CYD_MAX_CHANNELS][CYD_BLOCK_SIZE]; // oscillator output per channel (needed for ring modulation)
+	Uint8 sync[CYD_MAX_CHANNELS][CYD_BLOCK_SIZE]; // sync bit per channel
+	CydMixBuffer mix;
+	int order[CYD_MAX_CHANNELS], level_start[CYD_MAX_CHANNELS + 1], n_levels; // channels grouped so that each level only depends on the previous ones
+	int frames;
+	Uint32 active; // bit mask of channels that produce output during the block
+#ifndef CYD_DISABLE_FILTER
+	Sint32 filter[CYD_MAX_CHANNELS][CYD_BLOCK_SIZE]; // filter input per channel, filtered and mixed after all channels are rendered
+	int filter_frames[CYD_MAX_CHANNELS];
+#endif
+} CydBlock;
+
+#define CYD_MAX_THREADS 8
+
+typedef struct
+{
+	struct CydEngine_t *cyd;
+	int index;
+	volatile int quit;
+	SDL_Thread *thread;
+	SDL_sem *start, *done;
+	CydMixBuffer mix;
+} CydWorker;
+
+#define CYD_COMMAND_QUEUE_SIZE 256 // must be a power of two
+
+/* A deferred call run by the audio thread at the start of the next block */
+typedef struct CydCommand_t
+{
+	void (*execute)(void *context, const struct CydCommand_t *command);
+	void *context;
+	int chan;
+	int param[3];
+	void *ptr;
+} CydCommand;
+
+#ifdef CYD_PROFILE
+
+enum
+{
+	CYD_PROFILE_OSCILLATORS, // oscillator blocks and per-sample channels without FM
+	CYD_PROFILE_WAVETABLE, // envelope and mixing of channels that play a wavetable
+	CYD_PROFILE_FM, // everything done for FM channels
+	CYD_PROFILE_MIX, // envelope and mixing of other channels
+	CYD_PROFILE_FILTER,
+	CYD_PROFILE_FX, // reverb, chorus and crush of all FX buses
+	CYD_PROFILE_CALLBACK, // the tick callback, e.g. mus_advance_tick()
+	CYD_PROFILE_STAGES
+};
+
+typedef struct
+{
+	Uint64 stage[CYD_PROFILE_STAGES]; // all channels included
+	Uint64 channel[CYD_MAX_CHANNELS]; // all channel stages included
+	Uint64 frames; // frames rendered
+	Uint64 frequency; // counts per second
+} CydProfile;
+
+#endif
+
+#ifdef __GNUC__
+# define cyd_load_acquire(p) __atomic_load_n((p), __ATOMIC_ACQUIRE)
+# define cyd_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+#else
+// MSVC gives volatile accesses acquire/release semantics
+# define cyd_load_acquire(p) (*(p))
+# define cyd_store_release(p, v) (*(p) = (v))
+#endif
+
+/* Single producer, single consumer ring: head is only written by the posting thread and tail only by the audio thread */
+typedef struct
+{
+	CydCommand command[CYD_COMMAND_QUEUE_SIZE];
+	volatile Uint32 head, tail;
+} CydCommandQueue;
+
 typedef struct CydEngine_t
 {
 	CydChannel *channel;
@@ -166,6 +261,14 @@ typedef struct CydEngine_t
 #endif
 	Uint64 samples_played;
 	int oversample;
+	CydBlock *block;
+	CydCommandQueue *commands;
+	CydWorker *workers;
+	int n_workers, level; // level is the dependency level the workers are rendering
+#ifdef CYD_PROFILE
+	CydProfile profile; // block level stages only, see cyd_get_profile()
+	Uint64 profile_channel[CYD_MAX_CHANNELS][CYD_PROFILE_STAGES]; // only written by the thread rendering the channel
+#endif
 } CydEngine;
 
 enum
@@ -173,6 +276,8 @@ enum
 	CYD_PAUSED = 1,
 	CYD_CLIPPING = 2,
 	CYD_SINGLE_THREAD = 8,
+	CYD_BANDLIMITED = 16, // band-limited pulse, saw and triangle at 1x rate instead of oversampling
+	CYD_CONTROL_RATE_ENVELOPE = 32, // ADSR envelopes advanced every CYD_ENV_CONTROL_RATE samples with linear ramps
 };
 
 // YM2149 envelope shape flags, CONT is assumed to be always set
@@ -183,6 +288,9 @@ enum { CYD_YM_ENV_ATT = 1, CYD_YM_ENV_ALT = 2};
 
 void cyd_init(CydEngine *cyd, Uint16 sample_rate, int initial_channels);
 void cyd_set_oversampling(CydEngine *cyd, int oversampling);
+void cyd_set_bandlimited(CydEngine *cyd, int enable);
+void cyd_set_control_rate_envelope(CydEngine *cyd, int enable);
+void cyd_set_threads(CydEngine *cyd, int threads);
 void cyd_reserve_channels(CydEngine *cyd, int channels);
 void cyd_deinit(CydEngine *cyd);
 void cyd_reset(CydEngine *cyd);
@@ -193,6 +301,7 @@ void cyd_set_wavetable_offset(CydChannel *chn, Uint16 offset /* 0..0x1000 = 0-10
 void cyd_set_env_frequency(CydEngine *cyd, CydChannel *chn, Uint16 frequency);
 void cyd_set_env_shape(CydChannel *chn, Uint8 shape);
 void cyd_enable_gate(CydEngine *cyd, CydChannel *chn, Uint8 enable);
+void cyd_advance_envelopes(CydEngine *cyd, int frames); // no output, see mus_seek()
 void cyd_set_waveform(CydChannel *chn, Uint32 wave);
 void cyd_set_wave_entry(CydChannel *chn, const CydWavetableEntry * entry);
 void cyd_set_filter_coeffs(CydEngine * cyd, CydChannel *chn, Uint16 cutoff, Uint8 resonance);
@@ -206,6 +315,12 @@ int cyd_register(CydEngine * cyd);
 #endif
 int cyd_unregister(CydEngine * cyd);
 void cyd_lock(CydEngine *cyd, Uint8 enable);
+int cyd_post_command(CydEngine *cyd, const CydCommand *command);
+#ifdef CYD_PROFILE
+/* Time spent in each stage and channel since the last reset */
+void cyd_get_profile(CydEngine *cyd, CydProfile *profile);
+void cyd_reset_profile(CydEngine *cyd);
+#endif
 #ifdef ENABLEAUDIODUMP
 void cyd_enable_audio_dump(CydEngine *cyd);
 void cyd_disable_audio_dump(CydEngine *cyd);
@@ -220,6 +335,10 @@ void cyd_output_buffer_stereo(void *udata, Uint8 *_stream, int len);
 void cyd_output_buffer_stereo(int chan, void *_stream, int len, void *udata);
 #endif
 
+/* Overwrite left and right with frames samples (full scale is 32768 or 1.0), returns number of frames rendered */
+int cyd_output_buffer_planar(CydEngine *cyd, Sint32 *left, Sint32 *right, int frames);
+int cyd_output_buffer_planar_float(CydEngine *cyd, float *left, float *right, int frames);
+
 Sint32 cyd_env_output(const CydEngine *cyd, Uint32 channel_flags, const CydAdsr *adsr, Sint32 input);
 Uint32 cyd_cycle_adsr(const CydEngine *eng, Uint32 flags, Uint32 ym_env_shape, CydAdsr *adsr);
 
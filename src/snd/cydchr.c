@@ -25,6 +25,7 @@ OTHER DEALINGS IN THE SOFTWARE.
 
 #include "cyddefs.h"
 #include "cydchr.h"
+#include "macros.h"
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -36,86 +37,100 @@ OTHER DEALINGS IN THE SOFTWARE.
 # define CHORUS_ACCURACY 256
 #endif
 
-void cydchr_output(CydChorus *chr, Sint32 in_l, Sint32 in_r, Sint32 *out_l, Sint32 *out_r)
-{
-	++chr->pos_buf;
-	if (chr->pos_buf >= chr->buf_size)
-		chr->pos_buf = 0;
 
-	Sint32 in_c = (in_l + in_r) / 2;
-	chr->buffer[chr->pos_buf] = in_c;
-	chr->buffer[chr->pos_buf + chr->buf_size] = in_c;
-	
-	int acc_l = 0, acc_r = 0;
-	
-	for (int o = 0 ; o < CYD_CHORUS_OVERSAMPLE ; ++o)
-	{
+/* Delay in 1/CHORUS_ACCURACY samples at LFO phase */
+
+static inline int cydchr_delay(const CydChorus *chr, Uint32 phase)
+{
+	const int i = phase >> 24;
+	const Sint32 frac = (phase >> 8) & 0xffff;
+	const Sint32 s = chr->sine[i] + (Sint32)(((Sint64)(chr->sine[i + 1] - chr->sine[i]) * frac) >> 16);
 	
-		++chr->pos_l;
-		if (chr->pos_l >= chr->lut_size)
-			chr->pos_l = 0;
+	return chr->delay + (int)(((Sint64)chr->depth * s) >> 16);
+}
 
-		++chr->pos_r;
-		if (chr->pos_r >= chr->lut_size)
-			chr->pos_r = 0;
-			
+
+static inline Sint32 cydchr_tap(const CydChorus *chr, int delay)
+{
 #ifdef CYD_DISABLE_CHORUS_INTERPOLATION
-		int a = chr->buffer[(chr->pos_buf - chr->lut[chr->pos_l] + chr->buf_size)];
-			
-		if (chr->lut_size)
-			acc_l += a;
-		else
-			acc_l += in_c;
-			
-		a = chr->buffer[(chr->pos_buf - chr->lut[chr->pos_r] + chr->buf_size)];
-		acc_r += a; 
+	return chr->buffer[chr->pos_buf - delay + chr->buf_size];
 #else
-		int a = chr->buffer[(chr->pos_buf - chr->lut[chr->pos_l] / CHORUS_ACCURACY + chr->buf_size)];
-		int b = chr->buffer[(chr->pos_buf - chr->lut[chr->pos_l] / CHORUS_ACCURACY - 1 + chr->buf_size)];
-		int s = chr->lut[chr->pos_l] % CHORUS_ACCURACY;
-			
-		if (chr->lut_size)
-			acc_l += a + (b - a) * s / CHORUS_ACCURACY;
-		else
-			acc_l += in_c;
-			
-		a = chr->buffer[(chr->pos_buf - chr->lut[chr->pos_r] / CHORUS_ACCURACY + chr->buf_size)];
-		b = chr->buffer[(chr->pos_buf - chr->lut[chr->pos_r] / CHORUS_ACCURACY - 1 + chr->buf_size)];
-		s = chr->lut[chr->pos_r] % CHORUS_ACCURACY;
-		acc_r += a + (b - a) * s / CHORUS_ACCURACY; 
+	int a = chr->buffer[chr->pos_buf - delay / CHORUS_ACCURACY + chr->buf_size];
+	int b = chr->buffer[chr->pos_buf - delay / CHORUS_ACCURACY - 1 + chr->buf_size];
+	int s = delay % CHORUS_ACCURACY;
+	return a + (b - a) * s / CHORUS_ACCURACY;
 #endif
-	}
+}
+
+
+void cydchr_output_block(CydChorus *chr, const Sint32 *in_l, const Sint32 *in_r, Sint32 *out_l, Sint32 *out_r, int frames)
+{
+	const Uint32 step = chr->step / CYD_CHORUS_OVERSAMPLE;
 	
-	*out_l = acc_l / CYD_CHORUS_OVERSAMPLE;
-	*out_r = acc_r / CYD_CHORUS_OVERSAMPLE;
+	for (int f = 0 ; f < frames ; ++f)
+	{
+		++chr->pos_buf;
+		if (chr->pos_buf >= chr->buf_size)
+			chr->pos_buf = 0;
+
+		Sint32 in_c = (in_l[f] + in_r[f]) / 2;
+		chr->buffer[chr->pos_buf] = in_c;
+		chr->buffer[chr->pos_buf + chr->buf_size] = in_c;
+		
+		int acc_l = 0, acc_r = 0;
+		
+		for (int o = 0 ; o < CYD_CHORUS_OVERSAMPLE ; ++o)
+		{
+			chr->phase_l += step;
+			chr->phase_r += step;
+			
+			// with the LFO stopped the left channel is dry
+			if (chr->step)
+				acc_l += cydchr_tap(chr, cydchr_delay(chr, chr->phase_l));
+			else
+				acc_l += in_c;
+				
+			acc_r += cydchr_tap(chr, cydchr_delay(chr, chr->phase_r));
+		}
+		
+		out_l[f] = acc_l / CYD_CHORUS_OVERSAMPLE;
+		out_r[f] = acc_r / CYD_CHORUS_OVERSAMPLE;
+	}
+}
+
+
+void cydchr_output(CydChorus *chr, Sint32 in_l, Sint32 in_r, Sint32 *out_l, Sint32 *out_r)
+{
+	cydchr_output_block(chr, &in_l, &in_r, out_l, out_r, 1);
 }
 
 
 void cydchr_set(CydChorus *chr, int rate, int min_delay, int max_delay, int stereo_separation)
 {
 #ifdef STEREOOUTPUT
+	chr->min_delay = min_delay;
+	chr->max_delay = max_delay;
+	
 	if (rate)
 	{
-		int old = chr->lut_size;
-		chr->lut_size = CYD_CHORUS_OVERSAMPLE * chr->sample_rate * 4 * 10 / (10 + (rate - 1));
+		// one LFO cycle takes sample_rate * 4 * 10 / (10 + (rate - 1)) samples
+		chr->step = ((Uint64)(10 + (rate - 1)) << 32) / ((Uint64)chr->sample_rate * 4 * 10);
 		
-		chr->pos_l = 0;
-		chr->pos_r = (stereo_separation * chr->lut_size / 2 / 64) % chr->lut_size;
+		// keep the swing inside the delay line
+		const int limit = (chr->buf_size - 2) * CHORUS_ACCURACY;
+		chr->delay = my_min(limit, (Sint64)min_delay * CHORUS_ACCURACY * chr->sample_rate / 10000);
+		chr->depth = my_min(limit, (Sint64)max_delay * CHORUS_ACCURACY * chr->sample_rate / 10000) - chr->delay;
 		
-		if (old == chr->lut_size && min_delay == chr->min_delay && chr->max_delay == max_delay) return;
-		
-		chr->min_delay = min_delay;
-		chr->max_delay = max_delay;
-		
-		for (int i = 0 ; i < chr->lut_size ; ++i)
-			chr->lut[i] = (int)(((sin((double)i / chr->lut_size * M_PI * 2) * 0.5 + 0.5) * (max_delay - min_delay) + min_delay) * CHORUS_ACCURACY * chr->sample_rate / 10000) % (chr->buf_size * CHORUS_ACCURACY);
+		chr->phase_l = 0;
+		chr->phase_r = (Uint32)stereo_separation << 25; // 64 is half a cycle
 	}
 	else
 	{
-		chr->pos_l = 0;
-		chr->pos_r = 0;
-		chr->lut_size = 0;
-		chr->lut[0] = chr->sample_rate * min_delay / 10000;
+		chr->step = 0;
+		chr->phase_l = 0;
+		chr->phase_r = 0;
+		chr->delay = chr->sample_rate * min_delay / 10000;
+		chr->depth = 0;
 	}
 #endif
 }
@@ -127,14 +142,13 @@ void cydchr_init(CydChorus *chr, int sample_rate)
 	chr->sample_rate = sample_rate;
 	chr->buf_size = sample_rate * CYDCHR_SIZE / 1000;
 	chr->buffer = calloc(chr->buf_size, sizeof(chr->buffer[0]) * 2);
-	chr->lut = calloc(sample_rate * 4 * CYD_CHORUS_OVERSAMPLE, sizeof(chr->buffer[0]));
-	chr->lut_size = 0;
+	
+	for (int i = 0 ; i <= CYDCHR_SINE_SIZE ; ++i)
+		chr->sine[i] = (sin((double)i / CYDCHR_SINE_SIZE * M_PI * 2) * 0.5 + 0.5) * 65536;
 }
 
 
 void cydchr_deinit(CydChorus *chr)
 {
 	free(chr->buffer);
-	free(chr->lut);
 }
-
@@ -27,18 +27,23 @@ OTHER DEALINGS IN THE SOFTWARE.
 */
 
 #define CYDCHR_SIZE 50
+#define CYDCHR_SINE_SIZE 256
 
 #include "cydtypes.h"
 
 typedef struct
 {
-	Sint32 *buffer, *lut;
+	Sint32 *buffer;
 	int sample_rate;
 	int min_delay, max_delay;
-	int pos_l, pos_r, pos_buf, buf_size, lut_size;
+	int pos_buf, buf_size;
+	Uint32 phase_l, phase_r, step; // LFO phase accumulators, a full cycle is 1 << 32
+	int delay, depth; // LFO swing between delay and delay + depth
+	Sint32 sine[CYDCHR_SINE_SIZE + 1]; // 0.5 + 0.5 * sin() as 16.16, the last entry is the first one repeated for interpolation
 } CydChorus;
 
 void cydchr_output(CydChorus *chr, Sint32 in_l, Sint32 in_r, Sint32 *out_l, Sint32 *out_r);
+void cydchr_output_block(CydChorus *chr, const Sint32 *in_l, const Sint32 *in_r, Sint32 *out_l, Sint32 *out_r, int frames);
 void cydchr_set(CydChorus *chr, int rate /* 1 = 0.1 Hz */, int min_delay, int max_delay, int stereo_separation);
 
 void cydchr_init(CydChorus *chr, int sample_rate);
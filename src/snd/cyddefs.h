@@ -62,5 +62,8 @@ OTHER DEALINGS IN THE SOFTWARE.
 
 #define WAVE_AMP (1 << OUTPUT_BITS)
 #define BUFFER_GRANULARITY 150 // mutex is locked and audio generated in 150 sample blocks
+#define CYD_BLOCK_SIZE 64 // channels are rendered this many samples at a time between ticks
+#define CYD_ENV_CONTROL_RATE 16 // envelopes are advanced this many samples at a time when using CYD_CONTROL_RATE_ENVELOPE
+#define CYD_OSC_LANES (CYD_BLOCK_SIZE << MAX_OVERSAMPLE) // oversampled oscillator steps evaluated at once
 
 #endif
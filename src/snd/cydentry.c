@@ -26,15 +26,255 @@ OTHER DEALINGS IN THE SOFTWARE.
 #include "cydentry.h"
 #include "cyddefs.h"
 #include "freqs.h"
+#include "pack.h"
 #include "SDL_endian.h"
 #include <stdlib.h>
 #include <string.h>
 
 
+/*
+Sample data shared between entries with identical content, see cyd_wave_entry_share().
+The mip levels only depend on the data so they are shared as well.
+*/
+
+struct CydWaveData_t
+{
+	Uint64 hash;
+	Uint32 samples;
+	int refcount;
+	Sint16 *data;
+	Sint16 *mip[CYD_WAVE_MIP_LEVELS];
+	int mip_levels;
+	struct CydWaveData_t *next;
+};
+
+static CydWaveData *wave_store = NULL;
+
+
+static Uint64 hash_data(const Sint16 *data, Uint32 samples)
+{
+	// FNV-1a
+	
+	Uint64 hash = 14695981039346656037ULL;
+	
+	for (Uint32 i = 0 ; i < samples ; ++i)
+	{
+		hash = (hash ^ (Uint16)data[i]) * 1099511628211ULL;
+	}
+	
+	return hash;
+}
+
+
+static void release_shared(CydWavetableEntry *entry)
+{
+	CydWaveData *shared = entry->shared;
+	
+	if (--shared->refcount == 0)
+	{
+		for (CydWaveData **d = &wave_store ; *d ; d = &(*d)->next)
+		{
+			if (*d == shared)
+			{
+				*d = shared->next;
+				break;
+			}
+		}
+		
+		for (int i = 0 ; i < shared->mip_levels ; ++i)
+			free(shared->mip[i]);
+		
+		free(shared->data);
+		free(shared);
+	}
+	
+	entry->shared = NULL;
+	entry->data = NULL;
+	
+	for (int i = 0 ; i < CYD_WAVE_MIP_LEVELS ; ++i)
+		entry->mip[i] = NULL;
+	
+	entry->mip_levels = 0;
+}
+
+
+static void free_mips(CydWavetableEntry *entry)
+{
+	for (int i = 0 ; i < CYD_WAVE_MIP_LEVELS ; ++i)
+	{
+		if (entry->mip[i]) free(entry->mip[i]);
+		entry->mip[i] = NULL;
+	}
+	
+	entry->mip_levels = 0;
+}
+
+
+static inline Sint32 mip_tap(const Sint16 *src, int n, int i)
+{
+	return src[i < 0 ? 0 : (i >= n ? n - 1 : i)];
+}
+
+
+/*
+Each level is the previous one run through a 7-tap half-band lowpass 
+(-1 0 9 16 9 0 -1) / 32 and decimated by two. Level n has ceil(samples / 2^(n+1))
+samples so the playback position and loop points can simply be shifted.
+Returns 0 if out of memory, the levels built so far are kept.
+*/
+
+static int build_mips(CydWavetableEntry *entry)
+{
+	const Sint16 *src = entry->data;
+	int n = entry->samples;
+	
+	while (entry->mip_levels < CYD_WAVE_MIP_LEVELS && (n + 1) / 2 >= CYD_WAVE_MIP_MIN_SAMPLES)
+	{
+		int len = (n + 1) / 2;
+		Sint16 *dst = malloc(sizeof(*dst) * len);
+		
+		if (!dst)
+			return 0;
+		
+		for (int i = 0 ; i < len ; ++i)
+		{
+			const int c = i * 2;
+			Sint32 v = (16 * mip_tap(src, n, c) + 9 * (mip_tap(src, n, c - 1) + mip_tap(src, n, c + 1)) - (mip_tap(src, n, c - 3) + mip_tap(src, n, c + 3))) / 32;
+			
+			dst[i] = v < -32768 ? -32768 : (v > 32767 ? 32767 : v);
+		}
+		
+		entry->mip[entry->mip_levels++] = dst;
+		src = dst;
+		n = len;
+	}
+	
+	return 1;
+}
+
+
+int cyd_wave_entry_build_mips(CydWavetableEntry *entry)
+{
+	if (!entry->data)
+		return 0;
+	
+	if (entry->shared)
+	{
+		// shared data never changes so the levels of the shared data only need to be built once
+		
+		CydWaveData *shared = entry->shared;
+		
+		if (shared->mip_levels == 0)
+		{
+			int ok = build_mips(entry);
+			
+			shared->mip_levels = entry->mip_levels;
+			
+			for (int i = 0 ; i < entry->mip_levels ; ++i)
+				shared->mip[i] = entry->mip[i];
+			
+			return ok;
+		}
+		
+		entry->mip_levels = shared->mip_levels;
+		
+		for (int i = 0 ; i < CYD_WAVE_MIP_LEVELS ; ++i)
+			entry->mip[i] = i < shared->mip_levels ? shared->mip[i] : NULL;
+		
+		return 1;
+	}
+	
+	free_mips(entry);
+	
+	return build_mips(entry);
+}
+
+
+static void free_packed(CydWavetableEntry *entry)
+{
+	if (entry->packed) free(entry->packed);
+	entry->packed = NULL;
+	entry->packed_size = 0;
+}
+
+
 void cyd_wave_entry_deinit(CydWavetableEntry *entry)
 {
+	free_packed(entry);
+	
+	if (entry->shared)
+	{
+		release_shared(entry);
+		return;
+	}
+	
 	if (entry->data) free(entry->data);
 	entry->data = NULL;
+	free_mips(entry);
+}
+
+
+void cyd_wave_entry_share(CydWavetableEntry *entry)
+{
+	if (entry->shared || !entry->data)
+		return;
+	
+	const Uint64 hash = hash_data(entry->data, entry->samples);
+	CydWaveData *shared;
+	
+	for (shared = wave_store ; shared ; shared = shared->next)
+	{
+		if (shared->hash == hash && shared->samples == entry->samples && memcmp(shared->data, entry->data, sizeof(*entry->data) * entry->samples) == 0)
+			break;
+	}
+	
+	if (shared)
+	{
+		free(entry->data);
+		
+		if (shared->mip_levels == 0)
+		{
+			// adopt the levels built for this entry
+			
+			shared->mip_levels = entry->mip_levels;
+			
+			for (int i = 0 ; i < entry->mip_levels ; ++i)
+			{
+				shared->mip[i] = entry->mip[i];
+				entry->mip[i] = NULL;
+			}
+		}
+		
+		free_mips(entry);
+	}
+	else
+	{
+		shared = calloc(1, sizeof(*shared));
+		
+		// out of memory, the entry keeps its private data
+		if (!shared)
+			return;
+		
+		shared->hash = hash;
+		shared->samples = entry->samples;
+		shared->data = entry->data;
+		shared->mip_levels = entry->mip_levels;
+		
+		for (int i = 0 ; i < entry->mip_levels ; ++i)
+			shared->mip[i] = entry->mip[i];
+		
+		shared->next = wave_store;
+		wave_store = shared;
+	}
+	
+	++shared->refcount;
+	
+	entry->shared = shared;
+	entry->data = shared->data;
+	entry->mip_levels = shared->mip_levels;
+	
+	for (int i = 0 ; i < CYD_WAVE_MIP_LEVELS ; ++i)
+		entry->mip[i] = i < shared->mip_levels ? shared->mip[i] : NULL;
 }
 
 
@@ -42,7 +282,8 @@ void cyd_wave_entry_init(CydWavetableEntry *entry, const void *data, Uint32 n_sa
 {
 	if (data && n_samples > 0)
 	{
-		entry->data = realloc(entry->data, sizeof(*entry->data) * n_samples);
+		// shared data is never modified, the entry gets a private copy instead
+		Sint16 *dst = entry->shared ? malloc(sizeof(*dst) * n_samples) : realloc(entry->data, sizeof(*dst) * n_samples);
 		
 		for (int i = 0; i < n_samples ; ++i)
 		{
@@ -69,15 +310,59 @@ void cyd_wave_entry_init(CydWavetableEntry *entry, const void *data, Uint32 n_sa
 			if (channels > 1)
 				v /= channels;
 			
-			entry->data[i] = v * denom / nom;
+			dst[i] = v * denom / nom;
 		}
 		
+		if (entry->shared)
+			release_shared(entry);
+		else
+			free_mips(entry);
+		
+		free_packed(entry);
+		
+		entry->data = dst;
 		entry->samples = n_samples;
 	}
 	else
 	{
-		free(entry->data);
-		entry->data = NULL;
+		cyd_wave_entry_deinit(entry);
 		entry->samples = 0;
 	}
 }
+
+
+void cyd_wave_entry_init_packed(CydWavetableEntry *entry, Uint8 *packed, Uint32 packed_size, Uint32 n_samples)
+{
+	cyd_wave_entry_deinit(entry);
+	
+	entry->packed = packed;
+	entry->packed_size = packed_size;
+	entry->samples = n_samples;
+}
+
+
+int cyd_wave_entry_unpack(CydWavetableEntry *entry)
+{
+	if (!entry->packed)
+		return entry->data != NULL;
+	
+	Sint16 *data = NULL;
+	
+#ifndef CYD_DISABLE_WAVETABLE
+	if (entry->flags & CYD_WAVE_COMPRESSED_LPC)
+		data = lpcunpack(entry->packed, entry->packed_size, entry->samples);
+	else
+		data = bitunpack(entry->packed, entry->packed_size, entry->samples, (entry->flags >> 3) & 3);
+#endif
+	
+	free_packed(entry);
+	
+	if (data)
+	{
+		cyd_wave_entry_init(entry, data, entry->samples, CYD_WAVE_TYPE_SINT16, 1, 1, 1);
+		free(data);
+		return 1;
+	}
+	
+	return 0;
+}
@@ -28,13 +28,17 @@ OTHER DEALINGS IN THE SOFTWARE.
 
 #include "cydtypes.h"
 
+#define CYD_WAVE_MIP_LEVELS 4
+#define CYD_WAVE_MIP_MIN_SAMPLES 32
+
 enum
 {
 	CYD_WAVE_LOOP = 1,
 	CYD_WAVE_PINGPONG = 2, // ping-pong loop as in FT2
 	CYD_WAVE_NO_INTERPOLATION = 4,
 	CYD_WAVE_COMPRESSED_DELTA = 8,
-	CYD_WAVE_COMPRESSED_GRAY = 16
+	CYD_WAVE_COMPRESSED_GRAY = 16,
+	CYD_WAVE_COMPRESSED_LPC = 32 // packed with lpcpack(), the bitpack flags are ignored
 };
 
 typedef enum
@@ -44,6 +48,8 @@ typedef enum
 	CYD_WAVE_TYPE_UINT8 	// atari YM files?
 } CydWaveType;
 
+typedef struct CydWaveData_t CydWaveData;
+
 typedef struct
 {
 	Uint32 flags;
@@ -51,9 +57,37 @@ typedef struct
 	Uint32 samples, loop_begin, loop_end;
 	Uint16 base_note;
 	Sint16 *data; 
+	Sint16 *mip[CYD_WAVE_MIP_LEVELS]; // mip[n] is data decimated by 2^(n+1), see cyd_wave_entry_build_mips()
+	int mip_levels;
+	CydWaveData *shared; // data and mip are shared with other entries and must not be modified
+	Uint8 *packed; // bitpack()ed or lpcpack()ed data waiting for cyd_wave_entry_unpack(), data is NULL until then
+	Uint32 packed_size; // in bits
 } CydWavetableEntry;
 
 void cyd_wave_entry_init(CydWavetableEntry *entry, const void *data, Uint32 n_samples, CydWaveType sample_type, int channels, int denom, int nom);
 void cyd_wave_entry_deinit(CydWavetableEntry *entry);
 
+/* 
+Replace the sample data with a reference counted copy shared by all entries with the same content. 
+The reference is released by cyd_wave_entry_deinit() or cyd_wave_entry_init(). Not thread safe,
+entries should be shared and released from one thread. The entry stays private if out of memory.
+*/
+void cyd_wave_entry_share(CydWavetableEntry *entry);
+
+/*
+Take ownership of packed sample data (packed_size in bits) and decode it only when cyd_wave_entry_unpack()
+is called. The codec is selected by the entry flags as in the song files: lpcpack() if CYD_WAVE_COMPRESSED_LPC
+is set, otherwise bitpack() with the packing options in flags bits 3-4. The entry is silent until unpacked.
+Unpacking an entry that is playing should be done with the engine locked.
+*/
+void cyd_wave_entry_init_packed(CydWavetableEntry *entry, Uint8 *packed, Uint32 packed_size, Uint32 n_samples);
+int cyd_wave_entry_unpack(CydWavetableEntry *entry);
+
+/*
+Build the decimated mip levels that playback uses for high notes instead of skipping through the
+full rate data. Optional, entries without levels always play the original data. cyd_wave_entry_init()
+drops the levels so call this again after it or after modifying the data in place. Returns 0 if out of memory.
+*/
+int cyd_wave_entry_build_mips(CydWavetableEntry *entry);
+
 #endif
@@ -25,8 +25,13 @@ OTHER DEALINGS IN THE SOFTWARE.
 
 
 #include "cydflt.h"
+#include "cyd.h"
 #include "macros.h"
 #include <assert.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
   
 void cydflt_set_coeff(CydFilter *flt, Uint16 frequency, Uint16 resonance)
 {
@@ -69,3 +74,186 @@ Sint32 cydflt_output_bp(CydFilter *flt)
 {
 	return 3 * (flt->b3 - flt->b4);
 }
+
+
+static Sint32 cydflt_output(CydFilter *flt, Uint8 type)
+{
+	switch (type)
+	{
+		case FLT_BP: return cydflt_output_bp(flt);
+		default: case FLT_LP: return cydflt_output_lp(flt);
+		case FLT_HP: return cydflt_output_hp(flt);
+	}
+}
+
+
+#ifdef __SSE2__
+static __m128i cydflt_mul(__m128i a, __m128i b)
+{
+	// SSE2 has no 32-bit multiply so do the even and odd lanes separately
+	__m128i even = _mm_mul_epu32(a, b);
+	__m128i odd = _mm_mul_epu32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32));
+	return _mm_unpacklo_epi32(_mm_shuffle_epi32(even, _MM_SHUFFLE(0, 0, 2, 0)), _mm_shuffle_epi32(odd, _MM_SHUFFLE(0, 0, 2, 0)));
+}
+
+
+static __m128i cydflt_div2048(__m128i a)
+{
+	// rounds towards zero like the integer division
+	return _mm_srai_epi32(_mm_add_epi32(a, _mm_srli_epi32(_mm_srai_epi32(a, 31), 21)), 11);
+}
+
+
+static __m128i cydflt_stage(__m128i in, __m128i b, __m128i p, __m128i f)
+{
+	return _mm_sub_epi32(cydflt_div2048(cydflt_mul(in, p)), cydflt_div2048(cydflt_mul(b, f)));
+}
+
+
+static __m128i cydflt_clamp(__m128i a, __m128i lo, __m128i hi)
+{
+	__m128i m = _mm_cmpgt_epi32(a, hi);
+	a = _mm_or_si128(_mm_and_si128(m, hi), _mm_andnot_si128(m, a));
+	m = _mm_cmplt_epi32(a, lo);
+	return _mm_or_si128(_mm_and_si128(m, lo), _mm_andnot_si128(m, a));
+}
+
+
+static void cydflt_cycle_lanes(CydFilter * const *flt, const Uint8 *type, Sint32 * const *buffer, int frames)
+{
+	Sint32 lane[CYDFLT_BANK_LANES][8];
+	
+	for (int l = 0 ; l < CYDFLT_BANK_LANES ; ++l)
+	{
+		lane[l][0] = flt[l]->f;
+		lane[l][1] = flt[l]->q;
+		lane[l][2] = flt[l]->p;
+		lane[l][3] = flt[l]->b0;
+		lane[l][4] = flt[l]->b1;
+		lane[l][5] = flt[l]->b2;
+		lane[l][6] = flt[l]->b3;
+		lane[l][7] = flt[l]->b4;
+	}
+	
+#define LANES(i) _mm_set_epi32(lane[3][i], lane[2][i], lane[1][i], lane[0][i])
+	const __m128i f = LANES(0), q = LANES(1), p = LANES(2);
+	__m128i b0 = LANES(3), b1 = LANES(4), b2 = LANES(5), b3 = LANES(6), b4 = LANES(7);
+#undef LANES
+
+	const __m128i lo = _mm_set1_epi32(-32768), hi = _mm_set1_epi32(32767);
+	__m128i is_bp, is_hp;
+	
+	{
+		Sint32 bp[CYDFLT_BANK_LANES], hp[CYDFLT_BANK_LANES];
+		
+		for (int l = 0 ; l < CYDFLT_BANK_LANES ; ++l)
+		{
+			bp[l] = type[l] == FLT_BP ? -1 : 0;
+			hp[l] = type[l] == FLT_HP ? -1 : 0;
+		}
+		
+		is_bp = _mm_loadu_si128((const __m128i*)bp);
+		is_hp = _mm_loadu_si128((const __m128i*)hp);
+	}
+
+	for (int i = 0 ; i < frames ; ++i)
+	{
+		__m128i input = _mm_set_epi32(buffer[3][i], buffer[2][i], buffer[1][i], buffer[0][i]);
+		
+		input = _mm_sub_epi32(input, cydflt_div2048(cydflt_mul(q, b4)));
+		__m128i t1 = b1;
+		b1 = cydflt_stage(_mm_add_epi32(input, b0), b1, p, f);
+		__m128i t2 = b2;
+		b2 = cydflt_stage(_mm_add_epi32(b1, t1), b2, p, f);
+		t1 = b3;
+		b3 = cydflt_stage(_mm_add_epi32(b2, t2), b3, p, f);
+		b4 = cydflt_clamp(cydflt_stage(_mm_add_epi32(b3, t1), b4, p, f), lo, hi);
+		b0 = input;
+		
+		__m128i bp = _mm_sub_epi32(b3, b4);
+		bp = _mm_add_epi32(bp, _mm_add_epi32(bp, bp));
+		__m128i o = _mm_or_si128(_mm_and_si128(is_hp, _mm_sub_epi32(b0, b4)), _mm_andnot_si128(is_hp, b4));
+		o = _mm_or_si128(_mm_and_si128(is_bp, bp), _mm_andnot_si128(is_bp, o));
+		
+		Sint32 out[CYDFLT_BANK_LANES];
+		_mm_storeu_si128((__m128i*)out, o);
+		
+		for (int l = 0 ; l < CYDFLT_BANK_LANES ; ++l)
+			buffer[l][i] = out[l];
+	}
+	
+#define STORE(v, i) _mm_storeu_si128((__m128i*)state, v); for (int l = 0 ; l < CYDFLT_BANK_LANES ; ++l) lane[l][i] = state[l];
+	{
+		Sint32 state[CYDFLT_BANK_LANES];
+		STORE(b0, 3);
+		STORE(b1, 4);
+		STORE(b2, 5);
+		STORE(b3, 6);
+		STORE(b4, 7);
+	}
+#undef STORE
+
+	for (int l = 0 ; l < CYDFLT_BANK_LANES ; ++l)
+	{
+		flt[l]->b0 = lane[l][3];
+		flt[l]->b1 = lane[l][4];
+		flt[l]->b2 = lane[l][5];
+		flt[l]->b3 = lane[l][6];
+		flt[l]->b4 = lane[l][7];
+	}
+}
+#endif
+
+
+void cydflt_cycle_bank(CydFilter * const *flt, const Uint8 *type, Sint32 * const *buffer, const int *frames, int lanes)
+{
+	assert(lanes <= CYDFLT_BANK_LANES);
+	
+	int done = 0;
+	
+#ifdef __SSE2__
+	if (lanes > 1)
+	{
+		// unused lanes run a dummy filter on a dummy buffer
+		CydFilter dummy_flt = { 0 };
+		Sint32 dummy_buffer[CYD_BLOCK_SIZE] = { 0 };
+		CydFilter *lane_flt[CYDFLT_BANK_LANES];
+		Sint32 *lane_buffer[CYDFLT_BANK_LANES];
+		Uint8 lane_type[CYDFLT_BANK_LANES];
+		
+		done = frames[0];
+		
+		for (int l = 0 ; l < CYDFLT_BANK_LANES ; ++l)
+		{
+			if (l < lanes)
+			{
+				lane_flt[l] = flt[l];
+				lane_buffer[l] = buffer[l];
+				lane_type[l] = type[l];
+				done = my_min(done, frames[l]);
+			}
+			else
+			{
+				lane_flt[l] = &dummy_flt;
+				lane_buffer[l] = dummy_buffer;
+				lane_type[l] = FLT_LP;
+			}
+		}
+		
+		done = my_min(done, CYD_BLOCK_SIZE);
+		
+		cydflt_cycle_lanes(lane_flt, lane_type, lane_buffer, done);
+	}
+#endif
+	
+	// the rest of the lanes that are longer than the shortest lane
+	
+	for (int l = 0 ; l < lanes ; ++l)
+	{
+		for (int i = done ; i < frames[l] ; ++i)
+		{
+			cydflt_cycle(flt[l], buffer[l][i]);
+			buffer[l][i] = cydflt_output(flt[l], type[l]);
+		}
+	}
+}
@@ -43,4 +43,11 @@ Sint32 cydflt_output_lp(CydFilter *flt);
 Sint32 cydflt_output_hp(CydFilter *flt);
 Sint32 cydflt_output_bp(CydFilter *flt);
 
+#define CYDFLT_BANK_LANES 4
+
+/* Run up to CYDFLT_BANK_LANES filters side by side, buffer[lane] is filtered in place for frames[lane] samples 
+   and replaced with the FLT_LP, FLT_HP or FLT_BP output selected by type[lane]. The result is the same 
+   as calling cydflt_cycle() for each sample */
+void cydflt_cycle_bank(CydFilter * const *flt, const Uint8 *type, Sint32 * const *buffer, const int *frames, int lanes);
+
 #endif
@@ -25,6 +25,8 @@ OTHER DEALINGS IN THE SOFTWARE.
 
 #include "cydfx.h"
 #include "cyd.h"
+#include "macros.h"
+#include <string.h>
 
 #ifdef STEREOOUTPUT
 void cydfx_output(CydFx *fx, Sint32 fx_l, Sint32 fx_r, Sint32 *left, Sint32 *right)
@@ -78,6 +80,82 @@ Sint32 cydfx_output(CydFx *fx, Sint32 fx_input)
 }
 
 
+#ifdef STEREOOUTPUT
+void cydfx_output_block(CydFx *fx, const Sint32 *fx_l, const Sint32 *fx_r, Sint32 *out_l, Sint32 *out_r, int frames)
+{
+	for (int done = 0 ; done < frames ; done += CYD_BLOCK_SIZE)
+	{
+		const int n = my_min(CYD_BLOCK_SIZE, frames - done);
+		Sint32 left[CYD_BLOCK_SIZE], right[CYD_BLOCK_SIZE];
+		
+		memcpy(left, fx_l + done, n * sizeof(*left));
+		memcpy(right, fx_r + done, n * sizeof(*right));
+
+#ifndef CYD_DISABLE_FX
+
+		if (fx->flags & CYDFX_ENABLE_CHORUS)
+			cydchr_output_block(&fx->chr, fx_l + done, fx_r + done, left, right, n);
+
+		if (fx->flags & CYDFX_ENABLE_REVERB)
+		{
+			Sint32 rvb_l[CYD_BLOCK_SIZE], rvb_r[CYD_BLOCK_SIZE];
+			
+			cydrvb_output_block(&fx->rvb, fx_l + done, fx_l + done, rvb_l, rvb_r, n);
+			
+			for (int f = 0 ; f < n ; ++f)
+			{
+				left[f] += rvb_l[f];
+				right[f] += rvb_r[f];
+			}
+		}
+		
+		if (fx->flags & CYDFX_ENABLE_CRUSH)
+		{
+			for (int f = 0 ; f < n ; ++f)
+				cydcrush_output(&fx->crush, left[f], right[f], &left[f], &right[f]);
+		}
+	
+#endif // CYD_DISABLE_FX
+
+		for (int f = 0 ; f < n ; ++f)
+		{
+			out_l[done + f] += left[f];
+			out_r[done + f] += right[f];
+		}
+	}
+}
+
+#else
+
+void cydfx_output_block(CydFx *fx, const Sint32 *fx_input, Sint32 *output, int frames)
+{
+	for (int done = 0 ; done < frames ; done += CYD_BLOCK_SIZE)
+	{
+		const int n = my_min(CYD_BLOCK_SIZE, frames - done);
+		Sint32 v[CYD_BLOCK_SIZE];
+		
+		memcpy(v, fx_input + done, n * sizeof(*v));
+
+#ifndef CYD_DISABLE_FX
+
+		if (fx->flags & CYDFX_ENABLE_REVERB)
+			cydrvb_output_block(&fx->rvb, fx_input + done, v, n);
+		
+		if (fx->flags & CYDFX_ENABLE_CRUSH)
+		{
+			for (int f = 0 ; f < n ; ++f)
+				v[f] = cydcrush_output(&fx->crush, v[f]);
+		}
+	
+#endif // CYD_DISABLE_FX
+
+		for (int f = 0 ; f < n ; ++f)
+			output[done + f] += v[f];
+	}
+}
+#endif
+
+
 void cydfx_init(CydFx *fx, int rate)
 {
 #ifndef CYD_DISABLE_FX
@@ -65,8 +65,11 @@ typedef struct
 
 #ifdef STEREOOUTPUT
 void cydfx_output(CydFx *fx, Sint32 fx_l, Sint32 fx_r, Sint32 *left, Sint32 *right);
+/* Same as cydfx_output() for each frame but the result is added to out_l and out_r */
+void cydfx_output_block(CydFx *fx, const Sint32 *fx_l, const Sint32 *fx_r, Sint32 *out_l, Sint32 *out_r, int frames);
 #else
 Sint32 cydfx_output(CydFx *fx, Sint32 fx_input);
+void cydfx_output_block(CydFx *fx, const Sint32 *fx_input, Sint32 *output, int frames);
 #endif
 void cydfx_init(CydFx *fx, int rate);
 void cydfx_deinit(CydFx *fx);
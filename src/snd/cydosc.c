@@ -1,6 +1,11 @@
 #include "cydosc.h"
 #include "cyddefs.h"
 #include "cyd.h"
+#include "macros.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static inline Uint32 cyd_pulse(Uint32 acc, Uint32 pw) 
 {
@@ -166,3 +171,156 @@ Sint32 cyd_osc(Uint32 flags, Uint32 accumulator, Uint32 pw, Uint32 random, Uint3
 		break;
 	}
 }
+
+
+/* Evaluate n oscillator steps at once. Combined waveforms are built by ANDing every enabled
+   waveform, disabled ones are replaced by all ones. Output is identical to cyd_osc() */
+
+void cyd_osc_block(Uint32 flags, const Uint32 *accumulator, Uint32 pw, const Uint32 *random, const Uint32 *lfsr_acc, Sint32 *output, int n)
+{
+	const Uint32 wave = flags & WAVEFORMS & ~CYD_CHN_ENABLE_WAVE;
+
+#ifdef CYD_DISABLE_LFSR
+	if (wave == 0 || (wave & CYD_CHN_ENABLE_LFSR))
+#else
+	if (wave == 0)
+#endif
+	{
+		for (int i = 0 ; i < n ; ++i)
+			output[i] = WAVE_AMP / 2;
+		return;
+	}
+
+	const Uint32 pulse_off = (wave & CYD_CHN_ENABLE_PULSE) ? 0 : ~0;
+	const Uint32 saw_off = (wave & CYD_CHN_ENABLE_SAW) ? 0 : ~0;
+	const Uint32 tri_off = (wave & CYD_CHN_ENABLE_TRIANGLE) ? 0 : ~0;
+	const Uint32 noise_off = (wave & CYD_CHN_ENABLE_NOISE) ? 0 : ~0;
+	const Uint32 lfsr_off = (wave & CYD_CHN_ENABLE_LFSR) ? 0 : ~0;
+
+	int i = 0;
+
+#ifdef __SSE2__
+	/* The accumulator is shifted to at most 17 bits so signed compares are safe when pw is clamped the same way */
+	const __m128i pw4 = _mm_set1_epi32(my_min(pw << 4, 1 << 17));
+	const __m128i amp = _mm_set1_epi32(WAVE_AMP - 1), tri_amp = _mm_set1_epi32(WAVE_AMP * 2 - 1);
+	const __m128i p_off = _mm_set1_epi32(pulse_off), s_off = _mm_set1_epi32(saw_off), t_off = _mm_set1_epi32(tri_off);
+	const __m128i n_off = _mm_set1_epi32(noise_off), l_off = _mm_set1_epi32(lfsr_off);
+
+	for ( ; i + 4 <= n ; i += 4)
+	{
+		__m128i acc = _mm_loadu_si128((const __m128i*)&accumulator[i]);
+
+		__m128i pulse = _mm_andnot_si128(_mm_cmpgt_epi32(pw4, _mm_srli_epi32(acc, ACC_BITS - 17)), amp);
+		__m128i saw = _mm_and_si128(_mm_srli_epi32(acc, ACC_BITS - OUTPUT_BITS - 1), amp);
+		__m128i flip = _mm_srai_epi32(_mm_slli_epi32(acc, 32 - (ACC_BITS - 1)), 31); // ACC_LENGTH / 2 bit to all lanes
+		__m128i tri = _mm_and_si128(_mm_srli_epi32(_mm_xor_si128(acc, flip), ACC_BITS - OUTPUT_BITS - 2), tri_amp);
+		__m128i noise = _mm_and_si128(_mm_loadu_si128((const __m128i*)&random[i]), amp);
+		__m128i lfsr = _mm_loadu_si128((const __m128i*)&lfsr_acc[i]);
+
+		__m128i o = _mm_and_si128(_mm_or_si128(pulse, p_off), _mm_or_si128(saw, s_off));
+		o = _mm_and_si128(o, _mm_or_si128(tri, t_off));
+		o = _mm_and_si128(o, _mm_or_si128(noise, n_off));
+		o = _mm_and_si128(o, _mm_or_si128(lfsr, l_off));
+
+		_mm_storeu_si128((__m128i*)&output[i], o);
+	}
+#endif
+
+	for ( ; i < n ; ++i)
+	{
+		output[i] = (cyd_pulse(accumulator[i], pw) | pulse_off) & (cyd_saw(accumulator[i]) | saw_off)
+			& (cyd_triangle(accumulator[i]) | tri_off) & (cyd_noise(random[i]) | noise_off) & (lfsr_acc[i] | lfsr_off);
+	}
+}
+
+
+/* PolyBLEP residual for a step at phase 0, x is the distance to the step in samples (16.16 fixed point) */
+
+static inline Sint64 cyd_polyblep(Sint64 t, Sint64 step)
+{
+	if (t < step)
+	{
+		Sint64 x = 65536 - (t << 16) / step;
+		return -(x * x >> 16);
+	}
+	else if (t > ACC_LENGTH - step)
+	{
+		Sint64 x = 65536 - ((ACC_LENGTH - t) << 16) / step;
+		return x * x >> 16;
+	}
+
+	return 0;
+}
+
+
+/* PolyBLAMP residual (integrated PolyBLEP) for a change in slope at phase 0, 16.16 fixed point */
+
+static inline Sint64 cyd_polyblamp(Sint64 t, Sint64 step)
+{
+	if (t < step)
+	{
+		Sint64 x = 65536 - (t << 16) / step;
+		return (x * x >> 16) * x / 65536 / 6;
+	}
+	else if (t > ACC_LENGTH - step)
+	{
+		Sint64 x = 65536 - ((ACC_LENGTH - t) << 16) / step;
+		return (x * x >> 16) * x / 65536 / 6;
+	}
+
+	return 0;
+}
+
+
+int cyd_osc_is_bandlimited(Uint32 flags)
+{
+	switch (flags & WAVEFORMS & ~CYD_CHN_ENABLE_WAVE)
+	{
+		case CYD_CHN_ENABLE_PULSE:
+		case CYD_CHN_ENABLE_SAW:
+		case CYD_CHN_ENABLE_TRIANGLE:
+			return 1;
+
+		default:
+			return 0;
+	}
+}
+
+
+/* Pulse, saw or triangle at 1x rate with the discontinuities smoothed out with PolyBLEP (steps)
+   and PolyBLAMP (corners). step is the accumulator increment per output sample */
+
+Sint32 cyd_osc_bandlimited(Uint32 flags, Uint32 accumulator, Uint32 step, Uint32 pw)
+{
+	const Sint64 t = accumulator, dt = my_max(1, my_min(step, ACC_LENGTH / 2));
+
+	switch (flags & WAVEFORMS & ~CYD_CHN_ENABLE_WAVE)
+	{
+		case CYD_CHN_ENABLE_PULSE:
+		{
+			// falls at phase 0 and rises at the pulse width
+			const Sint64 edge = my_min((Sint64)pw << 12, ACC_LENGTH);
+			Sint64 o = cyd_pulse(accumulator, pw);
+			o += (WAVE_AMP / 2) * (cyd_polyblep((t - edge) & (ACC_LENGTH - 1), dt) - cyd_polyblep(t, dt)) >> 16;
+			return o;
+		}
+
+		case CYD_CHN_ENABLE_SAW:
+		{
+			Sint64 o = cyd_saw(accumulator);
+			o -= (WAVE_AMP / 2) * cyd_polyblep(t, dt) >> 16;
+			return o;
+		}
+
+		case CYD_CHN_ENABLE_TRIANGLE:
+		{
+			// rises by WAVE_AMP in half a cycle, the corners are at phase 0 and 1/2
+			Sint64 o = cyd_triangle(accumulator);
+			o += (dt * WAVE_AMP / (ACC_LENGTH / 4)) * (cyd_polyblamp(t, dt) - cyd_polyblamp((t + ACC_LENGTH / 2) & (ACC_LENGTH - 1), dt)) >> 16;
+			return o;
+		}
+
+		default:
+			return cyd_osc(flags, accumulator, pw, 0, 0);
+	}
+}
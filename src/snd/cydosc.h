@@ -3,3 +3,6 @@
 #include "cydtypes.h"
 
 Sint32 cyd_osc(Uint32 flags, Uint32 accumulator, Uint32 pw, Uint32 random, Uint32 lfsr_acc);
+void cyd_osc_block(Uint32 flags, const Uint32 *accumulator, Uint32 pw, const Uint32 *random, const Uint32 *lfsr_acc, Sint32 *output, int n);
+int cyd_osc_is_bandlimited(Uint32 flags);
+Sint32 cyd_osc_bandlimited(Uint32 flags, Uint32 accumulator, Uint32 step, Uint32 pw);
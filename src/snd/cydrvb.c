@@ -38,10 +38,16 @@ void cydrvb_init(CydReverb *rvb, int rate)
 	
 	rvb->size = bufsize;
 	rvb->rate = rate;
+	
+	// Room for a whole block on top of the longest delay so a block can be written before the taps are read
+	int ring = 1;
+	while (ring < bufsize + CYD_BLOCK_SIZE) ring <<= 1;
+	
+	rvb->mask = ring - 1;
 #ifdef STEREOOUTPUT
-	rvb->buffer = calloc(sizeof(*rvb->buffer) * 2, bufsize);
+	rvb->buffer = calloc(sizeof(*rvb->buffer) * 2, ring);
 #else
-	rvb->buffer = calloc(sizeof(*rvb->buffer), bufsize);
+	rvb->buffer = calloc(sizeof(*rvb->buffer), ring);
 #endif
 	
 	for (int i = 0 ; i < CYDRVB_TAPS ; ++i)
@@ -59,35 +65,17 @@ void cydrvb_deinit(CydReverb *rvb)
 #ifdef STEREOOUTPUT
 void cydrvb_cycle(CydReverb *rvb, Sint32 left, Sint32 right)
 {
-	for (int i = 0 ; i < CYDRVB_TAPS ; ++i)
-	{
-		++rvb->tap[i].position;
-		if (rvb->tap[i].position >= rvb->size)
-			rvb->tap[i].position = 0;
-	}
-	
-	++rvb->position;
-	if (rvb->position >= rvb->size)
-		rvb->position = 0;
+	rvb->position = (rvb->position + 1) & rvb->mask;
 		
-	rvb->buffer[rvb->position * 2] = left;
-	rvb->buffer[rvb->position * 2 + 1] = right;
+	rvb->buffer[rvb->position] = left;
+	rvb->buffer[rvb->position + rvb->mask + 1] = right;
 }
 
 #else
 
 void cydrvb_cycle(CydReverb *rvb, Sint32 input)
 {
-	for (int i = 0 ; i < CYDRVB_TAPS ; ++i)
-	{
-		++rvb->tap[i].position;
-		if (rvb->tap[i].position >= rvb->size)
-			rvb->tap[i].position = 0;
-	}
-	
-	++rvb->position;
-	if (rvb->position >= rvb->size)
-		rvb->position = 0;
+	rvb->position = (rvb->position + 1) & rvb->mask;
 		
 	rvb->buffer[rvb->position] = input;
 }
@@ -103,8 +91,9 @@ void cydrvb_output(CydReverb *rvb, Sint32 *left, Sint32 *right)
 	{
 		if (rvb->tap[i].gain_l != 0 || rvb->tap[i].gain_r != 0)
 		{
-			*left += rvb->tap[i].gain_l * (Sint32)rvb->buffer[rvb->tap[i].position * 2] / CYDRVB_0dB;
-			*right += rvb->tap[i].gain_r * (Sint32)rvb->buffer[rvb->tap[i].position * 2 + 1] / CYDRVB_0dB;
+			const int p = (rvb->position - rvb->tap[i].offset) & rvb->mask;
+			*left += rvb->tap[i].gain_l * rvb->buffer[p] / CYDRVB_0dB;
+			*right += rvb->tap[i].gain_r * rvb->buffer[p + rvb->mask + 1] / CYDRVB_0dB;
 		}
 	}
 }
@@ -119,7 +108,7 @@ Sint32 cydrvb_output(CydReverb *rvb)
 	{
 		if (rvb->tap[i].gain != 0)
 		{
-			o += rvb->tap[i].gain * rvb->buffer[rvb->tap[i].position] / CYDRVB_0dB;
+			o += rvb->tap[i].gain * rvb->buffer[(rvb->position - rvb->tap[i].offset) & rvb->mask] / CYDRVB_0dB;
 		}
 	}
 	
@@ -128,10 +117,79 @@ Sint32 cydrvb_output(CydReverb *rvb)
 #endif
 
 
+/* Add gain * src to dst, src is read from the ring starting at pos and wraps once at most */
+
+static void cydrvb_add_tap(const CydReverb *rvb, const Sint32 *ring, int pos, int gain, Sint32 *dst, int frames)
+{
+	const int span = my_min(frames, rvb->mask + 1 - pos);
+	
+	for (int f = 0 ; f < span ; ++f)
+		dst[f] += gain * ring[pos + f] / CYDRVB_0dB;
+		
+	for (int f = span ; f < frames ; ++f)
+		dst[f] += gain * ring[f - span] / CYDRVB_0dB;
+}
+
+
+static void cydrvb_write(CydReverb *rvb, Sint32 *ring, const Sint32 *input, int frames)
+{
+	const int pos = (rvb->position + 1) & rvb->mask;
+	const int span = my_min(frames, rvb->mask + 1 - pos);
+	
+	memcpy(ring + pos, input, span * sizeof(*input));
+	memcpy(ring, input + span, (frames - span) * sizeof(*input));
+}
+
+
+#ifdef STEREOOUTPUT
+void cydrvb_output_block(CydReverb *rvb, const Sint32 *in_l, const Sint32 *in_r, Sint32 *out_l, Sint32 *out_r, int frames)
+#else
+void cydrvb_output_block(CydReverb *rvb, const Sint32 *input, Sint32 *output, int frames)
+#endif
+{
+	for (int done = 0 ; done < frames ; )
+	{
+		// the ring has room for this many new samples without overwriting anything a tap still reads
+		const int n = my_min(CYD_BLOCK_SIZE, frames - done);
+		
+#ifdef STEREOOUTPUT
+		Sint32 *ring_r = rvb->buffer + rvb->mask + 1;
+		cydrvb_write(rvb, rvb->buffer, in_l + done, n);
+		cydrvb_write(rvb, ring_r, in_r + done, n);
+		memset(out_l + done, 0, n * sizeof(*out_l));
+		memset(out_r + done, 0, n * sizeof(*out_r));
+#else
+		cydrvb_write(rvb, rvb->buffer, input + done, n);
+		memset(output + done, 0, n * sizeof(*output));
+#endif
+		
+		for (int i = 0 ; i < CYDRVB_TAPS ; ++i)
+		{
+			const int pos = (rvb->position + 1 - rvb->tap[i].offset) & rvb->mask;
+			
+#ifdef STEREOOUTPUT
+			if (rvb->tap[i].gain_l != 0 || rvb->tap[i].gain_r != 0)
+			{
+				cydrvb_add_tap(rvb, rvb->buffer, pos, rvb->tap[i].gain_l, out_l + done, n);
+				cydrvb_add_tap(rvb, ring_r, pos, rvb->tap[i].gain_r, out_r + done, n);
+			}
+#else
+			if (rvb->tap[i].gain != 0)
+				cydrvb_add_tap(rvb, rvb->buffer, pos, rvb->tap[i].gain, output + done, n);
+#endif
+		}
+		
+		rvb->position = (rvb->position + n) & rvb->mask;
+		done += n;
+	}
+}
+
+
 void cydrvb_set_tap(CydReverb *rvb, int idx, int delay_ms, int gain_db, int panning)
 {
 	rvb->tap[idx].delay = delay_ms;
-	rvb->tap[idx].position = (rvb->position - (delay_ms * rvb->rate / 1000) + rvb->size) % rvb->size;
+	// a delay of exactly the max delay used to wrap around to zero
+	rvb->tap[idx].offset = (delay_ms * rvb->rate / 1000) % rvb->size;
 	
 	if (gain_db <= CYDRVB_LOW_LIMIT)
 	{
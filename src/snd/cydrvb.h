@@ -37,7 +37,7 @@ OTHER DEALINGS IN THE SOFTWARE.
 
 typedef struct
 {
-	int position;
+	int offset; // delay in samples behind the write position
 #ifdef STEREOOUTPUT
 	int gain_r, gain_l;
 #else
@@ -48,8 +48,9 @@ typedef struct
 
 typedef struct
 {
-	Sint32 *buffer;
-	int size, rate;
+	Sint32 *buffer; // power of two ring, in stereo the right channel follows the left one
+	int size, rate; // size is the max delay in samples
+	int mask; // ring length - 1
 	int position;
 	CydTap tap[CYDRVB_TAPS];
 } CydReverb;
@@ -60,9 +61,12 @@ void cydrvb_deinit(CydReverb *rvb);
 #ifdef STEREOOUTPUT
 void cydrvb_cycle(CydReverb *rvb, Sint32 left, Sint32 right);
 void cydrvb_output(CydReverb *rvb, Sint32 *left, Sint32 *right);
+/* Same as cydrvb_cycle() and cydrvb_output() for each frame */
+void cydrvb_output_block(CydReverb *rvb, const Sint32 *in_l, const Sint32 *in_r, Sint32 *out_l, Sint32 *out_r, int frames);
 #else
 void cydrvb_cycle(CydReverb *rvb, Sint32 input);
 Sint32 cydrvb_output(CydReverb *rvb);
+void cydrvb_output_block(CydReverb *rvb, const Sint32 *input, Sint32 *output, int frames);
 #endif
 
 void cydrvb_set_tap(CydReverb *rvb, int idx, int delay_ms, int gain_db, int panning);
@@ -45,56 +45,80 @@ static Sint32 cyd_wave_get_sample_no_interpolation(const CydWavetableEntry *entr
 }
 
 
-static Sint32 cyd_wave_get_sample_linear(const CydWavetableEntry *entry, CydWaveAcc wave_acc, int direction)
+static Sint32 cyd_wave_get_sample_linear(const CydWavetableEntry *entry, CydWaveAcc wave_acc, int direction, int level)
 {
 	if (entry->data)
 	{	
+		// level 0 is the original data, higher levels are the decimated mip tables
+		
+		const Sint16 *data = level ? entry->mip[level - 1] : entry->data;
+		const Sint32 samples = (entry->samples + (1 << level) - 1) >> level;
+		const Sint32 loop_begin = entry->loop_begin >> level;
+		const Sint32 loop_end = entry->loop_end >> level;
+		
+		wave_acc >>= level;
+		
 		if (direction == 0) 
 		{
 			int a = wave_acc / WAVETABLE_RESOLUTION;
 			int b = a + 1;
 			
-			if (a >= entry->samples || a < 0)
+			if (a >= samples || a < 0)
 				return 0;
 			
-			if ((entry->flags & CYD_WAVE_LOOP) && b >= entry->loop_end)
+			if ((entry->flags & CYD_WAVE_LOOP) && b >= loop_end)
 			{
 				if (!(entry->flags & CYD_WAVE_PINGPONG))
-					b = b - entry->loop_end + entry->loop_begin;
+					b = b - loop_end + loop_begin;
 				else
-					b = entry->loop_end - (b - entry->loop_end);
+					b = loop_end - (b - loop_end);
 			}
 			
-			if (b >= entry->samples)
-				return entry->data[a];
+			if (b >= samples)
+				return data[a];
 			else
-				return entry->data[a] + (entry->data[b] - entry->data[a]) * ((CydWaveAccSigned)wave_acc % WAVETABLE_RESOLUTION) / WAVETABLE_RESOLUTION;
+				return data[a] + (data[b] - data[a]) * ((CydWaveAccSigned)wave_acc % WAVETABLE_RESOLUTION) / WAVETABLE_RESOLUTION;
 		}
 		else
 		{
 			int a = wave_acc / WAVETABLE_RESOLUTION;
 			int b = a - 1;
 			
-			if (a >= entry->samples || a < 0)
+			if (a >= samples || a < 0)
 				return 0;
 			
-			if ((entry->flags & CYD_WAVE_LOOP) && b < (Sint32)entry->loop_begin)
+			if ((entry->flags & CYD_WAVE_LOOP) && b < loop_begin)
 			{
 				if (!(entry->flags & CYD_WAVE_PINGPONG))
-					b = b - entry->loop_begin + entry->loop_end;
+					b = b - loop_begin + loop_end;
 				else
-					b = entry->loop_begin - (b - entry->loop_begin);
+					b = loop_begin - (b - loop_begin);
 			}
 			
-			if (b < 0)
-				return entry->data[a];
+			if (b < 0 || b >= samples)
+				return data[a];
 			else
-				return entry->data[a] + (entry->data[b] - entry->data[a]) * (WAVETABLE_RESOLUTION - ((CydWaveAccSigned)wave_acc % WAVETABLE_RESOLUTION)) / WAVETABLE_RESOLUTION;
+				return data[a] + (data[b] - data[a]) * (WAVETABLE_RESOLUTION - ((CydWaveAccSigned)wave_acc % WAVETABLE_RESOLUTION)) / WAVETABLE_RESOLUTION;
 		}
 	}
 	else
 		return 0;
 }
+
+
+/*
+Pick the mip level where the wave advances less than two samples per output sample
+*/
+
+static int cyd_wave_get_level(const CydWaveState *state, const CydWavetableEntry *entry)
+{
+	int level = 0;
+	
+	while (level < entry->mip_levels && (state->frequency >> level) >= 2 * WAVETABLE_RESOLUTION)
+		++level;
+	
+	return level;
+}
 #endif // CYD_DISABLE_WAVETABLE
 
 
@@ -107,7 +131,7 @@ Sint32 cyd_wave_get_sample(const CydWaveState *state, const CydWavetableEntry *w
 	}
 	else
 	{
-		return cyd_wave_get_sample_linear(wave_entry, acc, state->direction);
+		return cyd_wave_get_sample_linear(wave_entry, acc, state->direction, cyd_wave_get_level(state, wave_entry));
 	}
 	
 #else
@@ -182,3 +206,156 @@ void cyd_wave_cycle(CydWaveState *wave, const CydWavetableEntry *wave_entry)
 	
 #endif // CYD_DISABLE_WAVETABLE
 }
+
+
+#ifndef CYD_DISABLE_WAVETABLE
+/*
+Number of frames (up to frames) that can be rendered from the current position before
+the interpolation needs a sample across a loop point or the end of the data, or 
+cyd_wave_cycle() would have to wrap or stop. Those frames go through the normal path.
+*/
+
+static int cyd_wave_run_length(const CydWaveState *wave, const CydWavetableEntry *entry, int level, int frames)
+{
+	const bool loop = (entry->flags & CYD_WAVE_LOOP) != 0;
+	const bool looped = loop && entry->loop_end != entry->loop_begin;
+	const bool interpolate = !(entry->flags & CYD_WAVE_NO_INTERPOLATION);
+	const Sint64 freq = wave->frequency;
+	const Sint64 samples = (entry->samples + (1 << level) - 1) >> level;
+	Sint64 n;
+	
+	if (!entry->data || freq == 0)
+		return 0;
+	
+	if (wave->direction == 0)
+	{
+		const Sint64 acc = wave->acc;
+		Sint64 last = (Sint64)(looped ? entry->loop_end : entry->samples) * WAVETABLE_RESOLUTION - freq;
+		
+		if (interpolate)
+		{
+			const Sint64 limit = loop ? my_min(samples, (Sint64)(entry->loop_end >> level)) : samples;
+			last = my_min(last, (limit - 1) * WAVETABLE_RESOLUTION * ((Sint64)1 << level));
+		}
+		
+		if (acc >= last)
+			return 0;
+		
+		n = (last - acc - 1) / freq + 1;
+	}
+	else
+	{
+		const Sint64 acc = (CydWaveAccSigned)wave->acc;
+		Sint64 first = (Sint64)(looped ? entry->loop_begin : 0) * WAVETABLE_RESOLUTION + freq;
+		
+		if (interpolate)
+		{
+			const Sint64 lower = loop ? (entry->loop_begin >> level) : 0;
+			first = my_max(first, (lower + 1) * WAVETABLE_RESOLUTION * ((Sint64)1 << level));
+		}
+		
+		if (acc < first || (interpolate && (acc >> level) >= samples * WAVETABLE_RESOLUTION))
+			return 0;
+		
+		n = (acc - first) / freq + 1;
+	}
+	
+	return n < frames ? n : frames;
+}
+
+
+#define CYD_WAVE_RUN 64
+
+/*
+Render frames that are known not to cross any boundary: positions are computed first 
+and the interpolation runs over plain arrays without any branches
+*/
+
+static void cyd_wave_render_run(const CydWaveState *wave, const CydWavetableEntry *entry, int level, Sint32 *output, int frames)
+{
+	const Sint16 *data = level ? entry->mip[level - 1] : entry->data;
+	const CydWaveAcc freq = wave->frequency;
+	Uint32 index[CYD_WAVE_RUN];
+	CydWaveAccSigned frac[CYD_WAVE_RUN];
+	
+	for (int start = 0 ; start < frames ; start += CYD_WAVE_RUN)
+	{
+		const int n = my_min(CYD_WAVE_RUN, frames - start);
+		const CydWaveAcc acc = wave->direction == 0 ? wave->acc + start * freq : wave->acc - start * freq;
+		Sint32 *out = output + start;
+		
+		if (entry->flags & CYD_WAVE_NO_INTERPOLATION)
+		{
+			for (int i = 0 ; i < n ; ++i)
+				out[i] = entry->data[(wave->direction == 0 ? acc + i * freq : acc - i * freq) / WAVETABLE_RESOLUTION];
+		}
+		else if (wave->direction == 0)
+		{
+			for (int i = 0 ; i < n ; ++i)
+			{
+				const CydWaveAcc p = (acc + i * freq) >> level;
+				index[i] = p / WAVETABLE_RESOLUTION;
+				frac[i] = p % WAVETABLE_RESOLUTION;
+			}
+			
+			for (int i = 0 ; i < n ; ++i)
+			{
+				const Sint32 a = data[index[i]], b = data[index[i] + 1];
+				out[i] = a + (b - a) * frac[i] / WAVETABLE_RESOLUTION;
+			}
+		}
+		else
+		{
+			for (int i = 0 ; i < n ; ++i)
+			{
+				const CydWaveAcc p = (acc - i * freq) >> level;
+				index[i] = p / WAVETABLE_RESOLUTION;
+				frac[i] = WAVETABLE_RESOLUTION - p % WAVETABLE_RESOLUTION;
+			}
+			
+			for (int i = 0 ; i < n ; ++i)
+			{
+				const Sint32 a = data[index[i]], b = data[index[i] - 1];
+				out[i] = a + (b - a) * frac[i] / WAVETABLE_RESOLUTION;
+			}
+		}
+	}
+}
+#endif // CYD_DISABLE_WAVETABLE
+
+
+void cyd_wave_render(CydWaveState *wave, const CydWavetableEntry *wave_entry, Sint32 *output, int frames)
+{
+#ifndef CYD_DISABLE_WAVETABLE
+	const int level = (wave_entry->flags & CYD_WAVE_NO_INTERPOLATION) ? 0 : cyd_wave_get_level(wave, wave_entry);
+	int f = 0;
+	
+	while (f < frames && wave->playing)
+	{
+		const int n = cyd_wave_run_length(wave, wave_entry, level, frames - f);
+		
+		if (n > 0)
+		{
+			cyd_wave_render_run(wave, wave_entry, level, output + f, n);
+			
+			if (wave->direction == 0)
+				wave->acc += (CydWaveAcc)n * wave->frequency;
+			else
+				wave->acc -= (CydWaveAcc)n * wave->frequency;
+			
+			f += n;
+		}
+		else
+		{
+			output[f++] = wave->frequency != 0 ? cyd_wave_get_sample(wave, wave_entry, wave->acc) : 0;
+			cyd_wave_cycle(wave, wave_entry);
+		}
+	}
+	
+	for ( ; f < frames ; ++f)
+		output[f] = 0;
+#else
+	for (int f = 0 ; f < frames ; ++f)
+		output[f] = 0;
+#endif // CYD_DISABLE_WAVETABLE
+}
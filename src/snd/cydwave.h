@@ -41,4 +41,7 @@ typedef struct
 Sint32 cyd_wave_get_sample(const CydWaveState *state, const CydWavetableEntry *wave_entry, CydWaveAcc acc);
 void cyd_wave_cycle(CydWaveState *wave, const CydWavetableEntry *wave_entry);
 
+/* Same as calling cyd_wave_get_sample() and cyd_wave_cycle() frames times, silent frames are zero */
+void cyd_wave_render(CydWaveState *wave, const CydWavetableEntry *wave_entry, Sint32 *output, int frames);
+
 #endif
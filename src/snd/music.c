@@ -90,8 +90,29 @@ static Sint8 sine_table[VIB_TAB_SIZE];
 
 #endif
 
+static Uint32 load_flags = 0;
+
 static int mus_trigger_instrument_internal(MusEngine* mus, int chan, MusInstrument *ins, Uint16 note, int panning);
 
+#define MUS_SIMULATION 0x80000000 // internal engine flag, see mus_init_simulation()
+
+#ifndef CYD_DISABLE_WAVETABLE
+/* Wave entries loaded with MUS_LOAD_LAZY_WAVETABLE are decoded when first bound to a channel,
+   except in a simulation which runs outside the lock and only needs the entry parameters */
+
+static CydWavetableEntry * mus_wave_entry(MusEngine *mus, int idx)
+{
+	CydWavetableEntry *entry = &mus->cyd->wavetable_entries[idx];
+
+	if (!(mus->flags & MUS_SIMULATION) && entry->packed && !cyd_wave_entry_unpack(entry))
+	{
+		warning("Sample data unpack failed");
+	}
+
+	return entry;
+}
+#endif
+
 #ifndef USESDL_RWOPS
 
 static int RWread(struct RWops *context, void *ptr, int size, int maxnum)
@@ -163,6 +184,110 @@ static RWops * RWFromFile(const char *name, const char *mode)
 }
 
 
+/* Songs, instruments and effects are parsed from memory, either in place or after reading
+   the whole stream at once. mus_load_instrument_RW() can be called in the middle of a stream
+   so a reader can also pass the reads through to the stream. */
+
+typedef struct
+{
+	const Uint8 *begin, *ptr, *end;
+	RWops *rw;
+} Reader;
+
+
+static void reader_init_memory(Reader *r, const void *data, size_t size)
+{
+	r->begin = r->ptr = data;
+	r->end = r->begin + size;
+	r->rw = NULL;
+}
+
+
+static void reader_init_rw(Reader *r, RWops *rw)
+{
+	r->begin = r->ptr = r->end = NULL;
+	r->rw = rw;
+}
+
+
+/* Same semantics as SDL_RWread(), reading past the end is a short read */
+static inline int reader_read(Reader *r, void *ptr, int size, int maxnum)
+{
+	if (r->rw)
+		return my_RWread(r->rw, ptr, size, maxnum);
+
+	size_t bytes = (size_t)size * maxnum;
+
+	if (bytes > (size_t)(r->end - r->ptr))
+		bytes = r->end - r->ptr;
+
+	if (bytes > 0)
+	{
+		memcpy(ptr, r->ptr, bytes);
+		r->ptr += bytes;
+	}
+
+	return size > 0 ? bytes / size : 0;
+}
+
+
+static inline Uint32 reader_tell(Reader *r)
+{
+	if (r->rw)
+		return my_RWtell(r->rw);
+
+	return r->ptr - r->begin;
+}
+
+
+/* Read everything left in the stream, returns NULL if out of memory */
+static Uint8 * read_stream(RWops *ctx, size_t *size)
+{
+	size_t allocated = 65536;
+	Uint8 *data = malloc(allocated);
+
+	*size = 0;
+
+	if (!data)
+		goto out_of_memory;
+
+	while (1)
+	{
+		int got = my_RWread(ctx, data + *size, 1, allocated - *size);
+
+		if (got <= 0)
+			break;
+
+		*size += got;
+
+		if (*size == allocated)
+		{
+			Uint8 *grown = realloc(data, allocated * 2);
+
+			if (!grown)
+			{
+				free(data);
+				goto out_of_memory;
+			}
+
+			data = grown;
+			allocated *= 2;
+		}
+	}
+
+	return data;
+
+out_of_memory:
+	warning("Out of memory while reading stream");
+	return NULL;
+}
+
+
+/* VER_READ() from macros.h reads from a RWops */
+#undef VER_READ
+#define VER_READ(file_version, first_version, last_version, var, size) VER(file_version, first_version, last_version, reader_read(ctx, var, size == 0 ? sizeof(*var) : size, 1));
+
+
 
 static void update_volumes(MusEngine *mus, MusTrackStatus *ts, MusChannel *chn, CydChannel *cydchn, int volume)
 {
@@ -331,7 +456,7 @@ static void mus_set_slide(MusEngine *mus, int chan, Uint16 note)
 }
 
 
-void mus_init_engine(MusEngine *mus, CydEngine *cyd)
+static void mus_reset_engine(MusEngine *mus, CydEngine *cyd)
 {
 	memset(mus, 0, sizeof(*mus));
 	mus->cyd = cyd;
@@ -344,6 +469,12 @@ void mus_init_engine(MusEngine *mus, CydEngine *cyd)
 #ifndef CYD_DISABLE_INACCURACY
 	mus->pitch_mask = ~0;
 #endif
+}
+
+
+void mus_init_engine(MusEngine *mus, CydEngine *cyd)
+{
+	mus_reset_engine(mus, cyd);
 
 #ifdef GENERATE_VIBRATO_TABLES
 	for (int i = 0 ; i < VIB_TAB_SIZE ; ++i)
@@ -701,7 +832,7 @@ static void do_command(MusEngine *mus, int chan, int tick, Uint16 inst, int from
 				{
 					if ((inst & 255) < CYD_WAVE_MAX_ENTRIES)
 					{
-						cydchn->fm.wave_entry = &mus->cyd->wavetable_entries[inst & 255];
+						cydchn->fm.wave_entry = mus_wave_entry(mus, inst & 255);
 					}
 				}
 				break;
@@ -871,7 +1002,7 @@ static void do_command(MusEngine *mus, int chan, int tick, Uint16 inst, int from
 				{
 					if ((inst & 255) < CYD_WAVE_MAX_ENTRIES)
 					{
-						cydchn->wave_entry = &mus->cyd->wavetable_entries[inst & 255];
+						cydchn->wave_entry = mus_wave_entry(mus, inst & 255);
 					}
 				}
 				break;
@@ -1239,7 +1370,7 @@ int mus_trigger_instrument_internal(MusEngine* mus, int chan, MusInstrument *ins
 #ifndef CYD_DISABLE_WAVETABLE
 	if (ins->cydflags & CYD_CHN_ENABLE_WAVE)
 	{
-		cyd_set_wave_entry(cydchn, &mus->cyd->wavetable_entries[ins->wavetable_entry]);
+		cyd_set_wave_entry(cydchn, mus_wave_entry(mus, ins->wavetable_entry));
 	}
 	else
 	{
@@ -1249,7 +1380,7 @@ int mus_trigger_instrument_internal(MusEngine* mus, int chan, MusInstrument *ins
 #ifndef CYD_DISABLE_FM
 	if (ins->fm_flags & CYD_FM_ENABLE_WAVE)
 	{
-		cydfm_set_wave_entry(&cydchn->fm, &mus->cyd->wavetable_entries[ins->fm_wave]);
+		cydfm_set_wave_entry(&cydchn->fm, mus_wave_entry(mus, ins->fm_wave));
 	}
 	else
 	{
@@ -1421,6 +1552,154 @@ Uint32 mus_ext_sync(MusEngine *mus)
 }
 
 
+/* A pattern step with everything the sequencer needs decoded */
+
+struct MusRow_t
+{
+	MusInstrument *instrument; // NULL if there is no instrument or it does not exist
+	Sint16 slide_speed; // from MUS_FX_SLIDE, -1 uses the instrument slide speed
+	Uint16 next_step; // MUS_FX_LOOP_PATTERN resolved
+	Uint8 note; // note offset added
+	Uint8 inst;
+	Uint8 ctrl; // MUS_FX_SLIDE adds MUS_CTRL_SLIDE and MUS_CTRL_LEGATO
+	Uint8 delay; // MUS_FX_EXT_NOTE_DELAY
+	Uint8 skip; // MUS_FX_SKIP_PATTERN
+};
+
+
+/* All patterns as they are played on each channel, rows[channel][sequence position] */
+
+struct MusCompiledSong_t
+{
+	const MusSong *song;
+	MusRow **rows[MUS_MAX_CHANNELS];
+	MusRow *data;
+};
+
+
+static void mus_decode_step(const MusSong *song, const MusPattern *pattern, int step, Sint8 note_offset, MusRow *row)
+{
+	const MusStep *s = &pattern->step[step];
+
+	row->note = s->note < 0xf0 ? s->note + note_offset : s->note;
+	row->inst = s->instrument;
+	row->instrument = s->instrument < song->num_instruments ? &song->instrument[s->instrument] : NULL;
+	row->ctrl = s->ctrl;
+	row->slide_speed = -1;
+	row->delay = 0;
+	row->skip = 0;
+	row->next_step = step + 1;
+
+	if ((s->command & 0xff00) == MUS_FX_SLIDE)
+	{
+		row->ctrl |= MUS_CTRL_SLIDE | MUS_CTRL_LEGATO;
+		row->slide_speed = s->command & 0xff;
+	}
+	else if ((s->command & 0xff00) == MUS_FX_LOOP_PATTERN)
+	{
+		row->next_step = s->command & 0xff;
+	}
+	else if ((s->command & 0xff00) == MUS_FX_SKIP_PATTERN)
+	{
+		row->skip = 1;
+	}
+	else if ((s->command & 0x7FF0) == MUS_FX_EXT_NOTE_DELAY)
+	{
+		row->delay = s->command & 0xf;
+	}
+}
+
+
+static void mus_free_compiled_song(MusCompiledSong *compiled)
+{
+	if (!compiled)
+		return;
+
+	for (int i = 0 ; i < MUS_MAX_CHANNELS ; ++i)
+		free(compiled->rows[i]);
+
+	free(compiled->data);
+	free(compiled);
+}
+
+
+/* Frees the compiled song replaced by mus_post_song(), called by the thread that posts songs */
+static void mus_free_retired_song(MusEngine *mus)
+{
+	MusCompiledSong *retired = cyd_load_acquire(&mus->retired);
+
+	if (retired)
+	{
+		mus_free_compiled_song(retired);
+		cyd_store_release(&mus->retired, NULL);
+	}
+}
+
+
+static MusCompiledSong * mus_compile_song(const MusSong *song)
+{
+	MusCompiledSong *compiled = calloc(1, sizeof(*compiled));
+	size_t total = 0;
+
+	if (!compiled)
+		goto out_of_memory;
+
+	compiled->song = song;
+
+	for (int i = 0 ; i < song->num_channels ; ++i)
+		for (int s = 0 ; s < song->num_sequences[i] ; ++s)
+			if (song->sequence[i][s].pattern < song->num_patterns)
+				total += song->pattern[song->sequence[i][s].pattern].num_steps;
+
+	MusRow *row = compiled->data = malloc(sizeof(*row) * my_max(1, total));
+
+	if (!row)
+		goto out_of_memory;
+
+	for (int i = 0 ; i < song->num_channels ; ++i)
+	{
+		compiled->rows[i] = calloc(my_max(1, song->num_sequences[i]), sizeof(compiled->rows[i][0]));
+
+		if (!compiled->rows[i])
+			goto out_of_memory;
+
+		for (int s = 0 ; s < song->num_sequences[i] ; ++s)
+		{
+			const MusSeqPattern *seq = &song->sequence[i][s];
+
+			if (seq->pattern >= song->num_patterns)
+				continue;
+
+			const MusPattern *pattern = &song->pattern[seq->pattern];
+
+			compiled->rows[i][s] = row;
+
+			for (int step = 0 ; step < pattern->num_steps ; ++step)
+				mus_decode_step(song, pattern, step, seq->note_offset, row++);
+		}
+	}
+
+	return compiled;
+
+out_of_memory:
+	warning("Out of memory while compiling song");
+	mus_free_compiled_song(compiled);
+	return NULL;
+}
+
+
+/* The current step of a track, decoded into temp if the song is not compiled */
+static const MusRow * mus_track_row(MusEngine *mus, MusTrackStatus *track_status, MusRow *temp)
+{
+	if (track_status->rows)
+		return &track_status->rows[track_status->pattern_step];
+
+	mus_decode_step(mus->song, track_status->pattern, track_status->pattern_step, track_status->note_offset, temp);
+
+	return temp;
+}
+
+
 int mus_advance_tick(void* udata)
 {
 	MusEngine *mus = udata;
@@ -1432,6 +1711,9 @@ int mus_advance_tick(void* udata)
 	{
 		if (mus->song)
 		{
+			// The compiled song is ignored if mus->song was changed directly
+			const MusCompiledSong *compiled = mus->compiled && mus->compiled->song == mus->song ? mus->compiled : NULL;
+
 			for (int i = 0 ; i < mus->song->num_channels ; ++i)
 			{
 				MusTrackStatus *track_status = &mus->song_track[i];
@@ -1447,29 +1729,24 @@ int mus_advance_tick(void* udata)
 						if (track_status->pattern_step >= mus->song->pattern[mus->song->sequence[i][track_status->sequence_position].pattern].num_steps)
 							track_status->pattern = NULL;
 						track_status->note_offset = mus->song->sequence[i][track_status->sequence_position].note_offset;
+						track_status->rows = compiled ? compiled->rows[i][track_status->sequence_position] : NULL;
 						++track_status->sequence_position;
 					}
 				}
 
-				int delay = 0;
-
-				if (track_status->pattern)
-				{
-					if ((track_status->pattern->step[track_status->pattern_step].command & 0x7FF0) == MUS_FX_EXT_NOTE_DELAY)
-						delay = track_status->pattern->step[track_status->pattern_step].command & 0xf;
-				}
+				MusRow temp;
+				const MusRow *row = track_status->pattern ? mus_track_row(mus, track_status, &temp) : NULL;
+				const int delay = row ? row->delay : 0;
 
 				if (mus->song_counter == delay)
 				{
-					if (track_status->pattern)
+					if (row)
 					{
 
 						if (1 || track_status->pattern_step == 0)
 						{
-							Uint8 note = track_status->pattern->step[track_status->pattern_step].note < 0xf0 ?
-								track_status->pattern->step[track_status->pattern_step].note + track_status->note_offset :
-								track_status->pattern->step[track_status->pattern_step].note;
-							Uint8 inst = track_status->pattern->step[track_status->pattern_step].instrument;
+							Uint8 note = row->note;
+							Uint8 inst = row->inst;
 							MusInstrument *pinst = NULL;
 
 							if (inst == MUS_NOTE_NO_INSTRUMENT)
@@ -1478,9 +1755,9 @@ int mus_advance_tick(void* udata)
 							}
 							else
 							{
-								if (inst < mus->song->num_instruments)
+								if (row->instrument)
 								{
-									pinst = &mus->song->instrument[inst];
+									pinst = row->instrument;
 									muschn->instrument = pinst;
 								}
 							}
@@ -1492,14 +1769,8 @@ int mus_advance_tick(void* udata)
 							else if (pinst && note != MUS_NOTE_NONE)
 							{
 								track_status->slide_speed = 0;
-								int speed = pinst->slide_speed | 1;
-								Uint8 ctrl = track_status->pattern->step[track_status->pattern_step].ctrl;
-
-								if ((track_status->pattern->step[track_status->pattern_step].command & 0xff00) == MUS_FX_SLIDE)
-								{
-									ctrl |= MUS_CTRL_SLIDE | MUS_CTRL_LEGATO;
-									speed = (track_status->pattern->step[track_status->pattern_step].command & 0xff);
-								}
+								int speed = row->slide_speed >= 0 ? row->slide_speed : pinst->slide_speed | 1;
+								Uint8 ctrl = row->ctrl;
 
 								if (ctrl & MUS_CTRL_SLIDE)
 								{
@@ -1566,13 +1837,10 @@ int mus_advance_tick(void* udata)
 
 					if (track_status->pattern)
 					{
-						Uint32 command = track_status->pattern->step[track_status->pattern_step].command;
-						if ((command & 0xff00) == MUS_FX_LOOP_PATTERN)
-						{
-							Uint16 step = command & 0xff;
-							track_status->pattern_step = step;
-						}
-						else if ((command & 0xff00) == MUS_FX_SKIP_PATTERN)
+						MusRow temp;
+						const MusRow *row = mus_track_row(mus, track_status, &temp);
+
+						if (row->skip)
 						{
 							mus->song_position += my_max(track_status->pattern->num_steps - track_status->pattern_step - 1, 0);
 							track_status->pattern = NULL;
@@ -1580,7 +1848,7 @@ int mus_advance_tick(void* udata)
 						}
 						else
 						{
-							++track_status->pattern_step;
+							track_status->pattern_step = row->next_step;
 						}
 
 						if (track_status->pattern && track_status->pattern_step >= track_status->pattern->num_steps)
@@ -1603,6 +1871,7 @@ int mus_advance_tick(void* udata)
 						MusTrackStatus *track_status = &mus->song_track[i];
 
 						track_status->pattern = NULL;
+						track_status->rows = NULL;
 						track_status->pattern_step = 0;
 						track_status->sequence_position = 0;
 					}
@@ -1645,9 +1914,8 @@ int mus_advance_tick(void* udata)
 }
 
 
-void mus_set_song(MusEngine *mus, MusSong *song, Uint16 position)
+static void mus_set_song_internal(MusEngine *mus, MusSong *song, Uint16 position)
 {
-	cyd_lock(mus->cyd, 1);
 	cyd_reset(mus->cyd);
 	mus->song = song;
 
@@ -1666,6 +1934,7 @@ void mus_set_song(MusEngine *mus, MusSong *song, Uint16 position)
 	for (int i = 0 ; i < MUS_MAX_CHANNELS ; ++i)
 	{
 		mus->song_track[i].pattern = NULL;
+		mus->song_track[i].rows = NULL;
 		mus->song_track[i].pattern_step = 0;
 		mus->song_track[i].sequence_position = 0;
 		mus->song_track[i].last_ctrl = 0;
@@ -1685,8 +1954,25 @@ void mus_set_song(MusEngine *mus, MusSong *song, Uint16 position)
 			mus->channel[i].volume = MAX_VOLUME;
 		}
 	}
+}
+
+
+void mus_set_song(MusEngine *mus, MusSong *song, Uint16 position)
+{
+	// Compile outside the lock so that the audio thread is not kept waiting
+
+	MusCompiledSong *compiled = song && (mus->flags & MUS_COMPILE_SONG) ? mus_compile_song(song) : NULL;
+
+	cyd_lock(mus->cyd, 1);
+
+	MusCompiledSong *old = mus->compiled;
+	mus->compiled = compiled;
+	mus_set_song_internal(mus, song, position);
 
 	cyd_lock(mus->cyd, 0);
+
+	mus_free_compiled_song(old);
+	mus_free_retired_song(mus);
 }
 
 
@@ -1764,7 +2050,7 @@ int mus_load_instrument(const char *path, MusInstrument *inst, CydWavetableEntry
 }
 
 
-static void load_wavetable_entry(Uint8 version, CydWavetableEntry * e, RWops *ctx)
+static void load_wavetable_entry(Uint8 version, CydWavetableEntry * e, Reader *ctx)
 {
 	VER_READ(version, 12, 0xff, &e->flags, 0);
 	VER_READ(version, 12, 0xff, &e->sample_rate, 0);
@@ -1786,7 +2072,7 @@ static void load_wavetable_entry(Uint8 version, CydWavetableEntry * e, RWops *ct
 		{
 			Sint16 *data = malloc(sizeof(data[0]) * e->samples);
 
-			my_RWread(ctx, data, sizeof(data[0]), e->samples);
+			reader_read(ctx, data, sizeof(data[0]), e->samples);
 
 			cyd_wave_entry_init(e, data, e->samples, CYD_WAVE_TYPE_SINT16, 1, 1, 1);
 
@@ -1797,33 +2083,27 @@ static void load_wavetable_entry(Uint8 version, CydWavetableEntry * e, RWops *ct
 			Uint32 data_size = 0;
 			VER_READ(version, 15, 0xff, &data_size, 0);
 			FIX_ENDIAN(data_size);
-			Uint8 *compressed = malloc(sizeof(Uint8) * data_size);
-
-			my_RWread(ctx, compressed, sizeof(Uint8), (data_size + 7) / 8); // data_size is in bits
+			Uint8 *compressed = malloc(sizeof(Uint8) * ((data_size + 7) / 8));
 
-			Sint16 *data = NULL;
+			reader_read(ctx, compressed, sizeof(Uint8), (data_size + 7) / 8); // data_size is in bits
 
-#ifndef CYD_DISABLE_WAVETABLE
-			data = bitunpack(compressed, data_size, e->samples, (e->flags >> 3) & 3);
-#endif
+			cyd_wave_entry_init_packed(e, compressed, data_size, e->samples);
 
-			if (data)
-			{
-				cyd_wave_entry_init(e, data, e->samples, CYD_WAVE_TYPE_SINT16, 1, 1, 1);
-				free(data);
-			}
-			else
+			if (!(load_flags & MUS_LOAD_LAZY_WAVETABLE) && !cyd_wave_entry_unpack(e))
 			{
 				warning("Sample data unpack failed");
 			}
+		}
 
-			free(compressed);
+		if ((load_flags & MUS_LOAD_WAVETABLE_MIPS) && e->data && !cyd_wave_entry_build_mips(e))
+		{
+			warning("Out of memory while building sample mip levels");
 		}
 	}
 }
 
 
-static int find_and_load_wavetable(Uint8 version, RWops *ctx, CydWavetableEntry *wavetable_entries)
+static int find_and_load_wavetable(Uint8 version, Reader *ctx, CydWavetableEntry *wavetable_entries)
 {
 	for (int i = 0 ; i < CYD_WAVE_MAX_ENTRIES ; ++i)
 	{
@@ -1840,11 +2120,11 @@ static int find_and_load_wavetable(Uint8 version, RWops *ctx, CydWavetableEntry
 }
 
 
-int mus_load_instrument_RW(Uint8 version, RWops *ctx, MusInstrument *inst, CydWavetableEntry *wavetable_entries)
+static int load_instrument(Uint8 version, Reader *ctx, MusInstrument *inst, CydWavetableEntry *wavetable_entries)
 {
 	mus_get_default_instrument(inst);
 
-	debug("Loading instrument at offset %x", (Uint32)my_RWtell(ctx));
+	debug("Loading instrument at offset %x", (Uint32)reader_tell(ctx));
 
 	_VER_READ(&inst->flags, 0);
 	_VER_READ(&inst->cydflags, 0);
@@ -1947,23 +2227,32 @@ int mus_load_instrument_RW(Uint8 version, RWops *ctx, MusInstrument *inst, CydWa
 }
 
 
-int mus_load_instrument_RW2(RWops *ctx, MusInstrument *inst, CydWavetableEntry *wavetable_entries)
+int mus_load_instrument_RW(Uint8 version, RWops *ctx, MusInstrument *inst, CydWavetableEntry *wavetable_entries)
+{
+	Reader r;
+	reader_init_rw(&r, ctx);
+
+	return load_instrument(version, &r, inst, wavetable_entries);
+}
+
+
+static int load_instrument2(Reader *ctx, MusInstrument *inst, CydWavetableEntry *wavetable_entries)
 {
 	char id[9];
 
 	id[8] = '\0';
 
-	my_RWread(ctx, id, 8, sizeof(id[0]));
+	reader_read(ctx, id, 8, sizeof(id[0]));
 
 	if (strcmp(id, MUS_INST_SIG) == 0)
 	{
 		Uint8 version = 0;
-		my_RWread(ctx, &version, 1, sizeof(version));
+		reader_read(ctx, &version, 1, sizeof(version));
 
 		if (version > MUS_VERSION)
 			return 0;
 
-		mus_load_instrument_RW(version, ctx, inst, wavetable_entries);
+		load_instrument(version, ctx, inst, wavetable_entries);
 
 		return 1;
 	}
@@ -1975,6 +2264,25 @@ int mus_load_instrument_RW2(RWops *ctx, MusInstrument *inst, CydWavetableEntry *
 }
 
 
+int mus_load_instrument_RW2(RWops *ctx, MusInstrument *inst, CydWavetableEntry *wavetable_entries)
+{
+	size_t size;
+	Uint8 *data = read_stream(ctx, &size);
+
+	if (!data)
+		return 0;
+
+	Reader r;
+	reader_init_memory(&r, data, size);
+
+	int result = load_instrument2(&r, inst, wavetable_entries);
+
+	free(data);
+
+	return result;
+}
+
+
 void mus_get_default_instrument(MusInstrument *inst)
 {
 	memset(inst, 0, sizeof(*inst));
@@ -2015,16 +2323,16 @@ void mus_set_fx(MusEngine *mus, MusSong *song)
 }
 
 
-static void inner_load_fx(RWops *ctx, CydFxSerialized *fx, int version)
+static void inner_load_fx(Reader *ctx, CydFxSerialized *fx, int version)
 {
 	Uint8 padding;
 
-	debug("fx @ %u", (Uint32)my_RWtell(ctx));
+	debug("fx @ %u", (Uint32)reader_tell(ctx));
 
 	if (version >= 22)
 	{
 		Uint8 len = 16;
-		my_RWread(ctx, &len, 1, 1);
+		reader_read(ctx, &len, 1, 1);
 		if (len)
 		{
 			memset(fx->name, 0, sizeof(fx->name));
@@ -2033,20 +2341,20 @@ static void inner_load_fx(RWops *ctx, CydFxSerialized *fx, int version)
 		}
 	}
 
-	my_RWread(ctx, &fx->flags, 1, 4);
-	my_RWread(ctx, &fx->crush.bit_drop, 1, 1);
-	my_RWread(ctx, &fx->chr.rate, 1, 1);
-	my_RWread(ctx, &fx->chr.min_delay, 1, 1);
-	my_RWread(ctx, &fx->chr.max_delay, 1, 1);
-	my_RWread(ctx, &fx->chr.sep, 1, 1);
+	reader_read(ctx, &fx->flags, 1, 4);
+	reader_read(ctx, &fx->crush.bit_drop, 1, 1);
+	reader_read(ctx, &fx->chr.rate, 1, 1);
+	reader_read(ctx, &fx->chr.min_delay, 1, 1);
+	reader_read(ctx, &fx->chr.max_delay, 1, 1);
+	reader_read(ctx, &fx->chr.sep, 1, 1);
 
 	Uint8 spread = 0;
 
 	if (version < 27)
-		my_RWread(ctx, &spread, 1, 1);
+		reader_read(ctx, &spread, 1, 1);
 
 	if (version < 21)
-		my_RWread(ctx, &padding, 1, 1);
+		reader_read(ctx, &padding, 1, 1);
 
 	int taps = CYDRVB_TAPS;
 
@@ -2055,13 +2363,13 @@ static void inner_load_fx(RWops *ctx, CydFxSerialized *fx, int version)
 
 	for (int i = 0 ; i < taps ; ++i)
 	{
-		my_RWread(ctx, &fx->rvb.tap[i].delay, 2, 1);
-		my_RWread(ctx, &fx->rvb.tap[i].gain, 2, 1);
+		reader_read(ctx, &fx->rvb.tap[i].delay, 2, 1);
+		reader_read(ctx, &fx->rvb.tap[i].gain, 2, 1);
 
 		if (version >= 27)
 		{
-			my_RWread(ctx, &fx->rvb.tap[i].panning, 1, 1);
-			my_RWread(ctx, &fx->rvb.tap[i].flags, 1, 1);
+			reader_read(ctx, &fx->rvb.tap[i].panning, 1, 1);
+			reader_read(ctx, &fx->rvb.tap[i].flags, 1, 1);
 		}
 		else
 		{
@@ -2100,7 +2408,7 @@ static void inner_load_fx(RWops *ctx, CydFxSerialized *fx, int version)
 		}
 	}
 
-	my_RWread(ctx, &fx->crushex.downsample, 1, 1);
+	reader_read(ctx, &fx->crushex.downsample, 1, 1);
 
 	if (version < 19)
 	{
@@ -2108,24 +2416,24 @@ static void inner_load_fx(RWops *ctx, CydFxSerialized *fx, int version)
 	}
 	else
 	{
-		my_RWread(ctx, &fx->crushex.gain, 1, 1);
+		reader_read(ctx, &fx->crushex.gain, 1, 1);
 	}
 
 	FIX_ENDIAN(fx->flags);
 }
 
 
-int mus_load_fx_RW(RWops *ctx, CydFxSerialized *fx)
+static int load_fx(Reader *ctx, CydFxSerialized *fx)
 {
 	char id[9];
 	id[8] = '\0';
 
-	my_RWread(ctx, id, 8, sizeof(id[0]));
+	reader_read(ctx, id, 8, sizeof(id[0]));
 
 	if (strcmp(id, MUS_FX_SIG) == 0)
 	{
 		Uint8 version = 0;
-		my_RWread(ctx, &version, 1, sizeof(version));
+		reader_read(ctx, &version, 1, sizeof(version));
 
 		debug("FX version = %u", version);
 
@@ -2138,6 +2446,25 @@ int mus_load_fx_RW(RWops *ctx, CydFxSerialized *fx)
 }
 
 
+int mus_load_fx_RW(RWops *ctx, CydFxSerialized *fx)
+{
+	size_t size;
+	Uint8 *data = read_stream(ctx, &size);
+
+	if (!data)
+		return 0;
+
+	Reader r;
+	reader_init_memory(&r, data, size);
+
+	int result = load_fx(&r, fx);
+
+	free(data);
+
+	return result;
+}
+
+
 int mus_load_fx_file(FILE *f, CydFxSerialized *fx)
 {
 	RWops *rw = RWFromFP(f, 0);
@@ -2172,17 +2499,17 @@ int mus_load_fx(const char *path, CydFxSerialized *fx)
 }
 
 
-int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_entries)
+static int load_song(Reader *ctx, MusSong *song, CydWavetableEntry *wavetable_entries)
 {
 	char id[9];
 	id[8] = '\0';
 
-	my_RWread(ctx, id, 8, sizeof(id[0]));
+	reader_read(ctx, id, 8, sizeof(id[0]));
 
 	if (strcmp(id, MUS_SONG_SIG) == 0)
 	{
 		Uint8 version = 0;
-		my_RWread(ctx, &version, 1, sizeof(version));
+		reader_read(ctx, &version, 1, sizeof(version));
 
 		debug("Song version = %u", version);
 
@@ -2193,7 +2520,7 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 		}
 
 		if (version >= 6)
-			my_RWread(ctx, &song->num_channels, 1, sizeof(song->num_channels));
+			reader_read(ctx, &song->num_channels, 1, sizeof(song->num_channels));
 		else
 		{
 			if (version > 3)
@@ -2202,36 +2529,36 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 				song->num_channels = 3;
 		}
 
-		my_RWread(ctx, &song->time_signature, 1, sizeof(song->time_signature));
+		reader_read(ctx, &song->time_signature, 1, sizeof(song->time_signature));
 
 		if (version >= 17)
 		{
-			my_RWread(ctx, &song->sequence_step, 1, sizeof(song->sequence_step));
+			reader_read(ctx, &song->sequence_step, 1, sizeof(song->sequence_step));
 		}
 
-		my_RWread(ctx, &song->num_instruments, 1, sizeof(song->num_instruments));
-		my_RWread(ctx, &song->num_patterns, 1, sizeof(song->num_patterns));
-		my_RWread(ctx, song->num_sequences, 1, sizeof(song->num_sequences[0]) * (int)song->num_channels);
-		my_RWread(ctx, &song->song_length, 1, sizeof(song->song_length));
+		reader_read(ctx, &song->num_instruments, 1, sizeof(song->num_instruments));
+		reader_read(ctx, &song->num_patterns, 1, sizeof(song->num_patterns));
+		reader_read(ctx, song->num_sequences, 1, sizeof(song->num_sequences[0]) * (int)song->num_channels);
+		reader_read(ctx, &song->song_length, 1, sizeof(song->song_length));
 
-		my_RWread(ctx, &song->loop_point, 1, sizeof(song->loop_point));
+		reader_read(ctx, &song->loop_point, 1, sizeof(song->loop_point));
 
 		if (version >= 12)
-			my_RWread(ctx, &song->master_volume, 1, 1);
+			reader_read(ctx, &song->master_volume, 1, 1);
 
-		my_RWread(ctx, &song->song_speed, 1, sizeof(song->song_speed));
-		my_RWread(ctx, &song->song_speed2, 1, sizeof(song->song_speed2));
-		my_RWread(ctx, &song->song_rate, 1, sizeof(song->song_rate));
+		reader_read(ctx, &song->song_speed, 1, sizeof(song->song_speed));
+		reader_read(ctx, &song->song_speed2, 1, sizeof(song->song_speed2));
+		reader_read(ctx, &song->song_rate, 1, sizeof(song->song_rate));
 
-		if (version > 2) my_RWread(ctx, &song->flags, 1, sizeof(song->flags));
+		if (version > 2) reader_read(ctx, &song->flags, 1, sizeof(song->flags));
 		else song->flags = 0;
 
-		if (version >= 9) my_RWread(ctx, &song->multiplex_period, 1, sizeof(song->multiplex_period));
+		if (version >= 9) reader_read(ctx, &song->multiplex_period, 1, sizeof(song->multiplex_period));
 		else song->multiplex_period = 3;
 
 		if (version >= 16)
 		{
-			my_RWread(ctx, &song->pitch_inaccuracy, 1, sizeof(song->pitch_inaccuracy));
+			reader_read(ctx, &song->pitch_inaccuracy, 1, sizeof(song->pitch_inaccuracy));
 		}
 		else
 		{
@@ -2254,20 +2581,20 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 
 		if (version >= 11)
 		{
-			my_RWread(ctx, &title_len, 1, 1);
+			reader_read(ctx, &title_len, 1, 1);
 		}
 
 		if (version >= 5)
 		{
 			memset(song->title, 0, sizeof(song->title));
-			my_RWread(ctx, song->title, 1, my_min(sizeof(song->title), title_len));
+			reader_read(ctx, song->title, 1, my_min(sizeof(song->title), title_len));
 			song->title[sizeof(song->title) - 1] = '\0';
 		}
 
 		Uint8 n_fx = 0;
 
 		if (version >= 10)
-			my_RWread(ctx, &n_fx, 1, sizeof(n_fx));
+			reader_read(ctx, &n_fx, 1, sizeof(n_fx));
 		else if (song->flags & MUS_ENABLE_REVERB)
 			n_fx = 1;
 
@@ -2278,7 +2605,7 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 			{
 				memset(&song->fx, 0, sizeof(song->fx[0]) * n_fx);
 
-				debug("Loading fx at offset %x (%d/%d)", (Uint32)my_RWtell(ctx), (int)sizeof(song->fx[0]) * n_fx, (int)sizeof(song->fx[0]));
+				debug("Loading fx at offset %x (%d/%d)", (Uint32)reader_tell(ctx), (int)sizeof(song->fx[0]) * n_fx, (int)sizeof(song->fx[0]));
 
 				for (int fx = 0 ; fx < n_fx ; ++fx)
 					inner_load_fx(ctx, &song->fx[fx], version);
@@ -2292,9 +2619,9 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 
 					for (int i = 0 ; i < 8 ; ++i)
 					{
-						Sint32 g, d;
-						my_RWread(ctx, &g, 1, sizeof(g));
-						my_RWread(ctx, &d, 1, sizeof(d));
+						Sint32 g = 0, d = 0;
+						reader_read(ctx, &g, 1, sizeof(g));
+						reader_read(ctx, &d, 1, sizeof(d));
 
 						song->fx[fx].rvb.tap[i].gain = g;
 						song->fx[fx].rvb.tap[i].delay = d;
@@ -2317,10 +2644,10 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 
 		if (version >= 13)
 		{
-			debug("Loading default volumes at offset %x", (Uint32)my_RWtell(ctx));
-			my_RWread(ctx, &song->default_volume[0], sizeof(song->default_volume[0]), song->num_channels);
-			debug("Loading default panning at offset %x", (Uint32)my_RWtell(ctx));
-			my_RWread(ctx, &song->default_panning[0], sizeof(song->default_panning[0]), song->num_channels);
+			debug("Loading default volumes at offset %x", (Uint32)reader_tell(ctx));
+			reader_read(ctx, &song->default_volume[0], sizeof(song->default_volume[0]), song->num_channels);
+			debug("Loading default panning at offset %x", (Uint32)reader_tell(ctx));
+			reader_read(ctx, &song->default_panning[0], sizeof(song->default_panning[0]), song->num_channels);
 		}
 
 		if (song->instrument == NULL)
@@ -2330,7 +2657,7 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 
 		for (int i = 0 ; i < song->num_instruments; ++i)
 		{
-			mus_load_instrument_RW(version, ctx, &song->instrument[i], NULL);
+			load_instrument(version, ctx, &song->instrument[i], NULL);
 		}
 
 
@@ -2343,15 +2670,15 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 
 				if (version < 8)
 				{
-					my_RWread(ctx, song->sequence[i], song->num_sequences[i], sizeof(song->sequence[i][0]));
+					reader_read(ctx, song->sequence[i], song->num_sequences[i], sizeof(song->sequence[i][0]));
 				}
 				else
 				{
 					for (int s = 0 ; s < song->num_sequences[i] ; ++s)
 					{
-						my_RWread(ctx, &song->sequence[i][s].position, 1, sizeof(song->sequence[i][s].position));
-						my_RWread(ctx, &song->sequence[i][s].pattern, 1, sizeof(song->sequence[i][s].pattern));
-						my_RWread(ctx, &song->sequence[i][s].note_offset, 1, sizeof(song->sequence[i][s].note_offset));
+						reader_read(ctx, &song->sequence[i][s].position, 1, sizeof(song->sequence[i][s].position));
+						reader_read(ctx, &song->sequence[i][s].pattern, 1, sizeof(song->sequence[i][s].pattern));
+						reader_read(ctx, &song->sequence[i][s].note_offset, 1, sizeof(song->sequence[i][s].note_offset));
 					}
 				}
 
@@ -2372,7 +2699,7 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 		for (int i = 0 ; i < song->num_patterns; ++i)
 		{
 			Uint16 steps;
-			my_RWread(ctx, &steps, 1, sizeof(song->pattern[i].num_steps));
+			reader_read(ctx, &steps, 1, sizeof(song->pattern[i].num_steps));
 
 			FIX_ENDIAN(steps);
 
@@ -2384,7 +2711,7 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 			song->pattern[i].num_steps = steps;
 
 			if (version >= 24)
-				my_RWread(ctx, &song->pattern[i].color, 1, sizeof(song->pattern[i].color));
+				reader_read(ctx, &song->pattern[i].color, 1, sizeof(song->pattern[i].color));
 			else
 				song->pattern[i].color = 0;
 
@@ -2398,7 +2725,7 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 
 				for (int step = 0 ; step < song->pattern[i].num_steps ; ++step)
 				{
-					my_RWread(ctx, &song->pattern[i].step[step], 1, s);
+					reader_read(ctx, &song->pattern[i].step[step], 1, s);
 					FIX_ENDIAN(song->pattern[i].step[step].command);
 				}
 			}
@@ -2409,25 +2736,25 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 				Uint8 *packed = malloc(sizeof(Uint8) * len);
 				Uint8 *current = packed;
 
-				my_RWread(ctx, packed, sizeof(Uint8), len);
+				reader_read(ctx, packed, sizeof(Uint8), len);
 
 				for (int s = 0 ; s < song->pattern[i].num_steps ; ++s)
 				{
 					Uint8 bits = (s & 1 || s == song->pattern[i].num_steps - 1) ? (*current & 0xf) : (*current >> 4);
 
 					if (bits & MUS_PAK_BIT_NOTE)
-						my_RWread(ctx, &song->pattern[i].step[s].note, 1, sizeof(song->pattern[i].step[s].note));
+						reader_read(ctx, &song->pattern[i].step[s].note, 1, sizeof(song->pattern[i].step[s].note));
 					else
 						song->pattern[i].step[s].note = MUS_NOTE_NONE;
 
 					if (bits & MUS_PAK_BIT_INST)
-						my_RWread(ctx, &song->pattern[i].step[s].instrument, 1, sizeof(song->pattern[i].step[s].instrument));
+						reader_read(ctx, &song->pattern[i].step[s].instrument, 1, sizeof(song->pattern[i].step[s].instrument));
 					else
 						song->pattern[i].step[s].instrument = MUS_NOTE_NO_INSTRUMENT;
 
 					if (bits & MUS_PAK_BIT_CTRL)
 					{
-						my_RWread(ctx, &song->pattern[i].step[s].ctrl, 1, sizeof(song->pattern[i].step[s].ctrl));
+						reader_read(ctx, &song->pattern[i].step[s].ctrl, 1, sizeof(song->pattern[i].step[s].ctrl));
 
 						if (version >= 14)
 							bits |= song->pattern[i].step[s].ctrl & ~7;
@@ -2438,7 +2765,7 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 						song->pattern[i].step[s].ctrl = 0;
 
 					if (bits & MUS_PAK_BIT_CMD)
-						my_RWread(ctx, &song->pattern[i].step[s].command, 1, sizeof(song->pattern[i].step[s].command));
+						reader_read(ctx, &song->pattern[i].step[s].command, 1, sizeof(song->pattern[i].step[s].command));
 					else
 						song->pattern[i].step[s].command = 0;
 
@@ -2446,7 +2773,7 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 
 					if (bits & MUS_PAK_BIT_VOLUME)
 					{
-						my_RWread(ctx, &song->pattern[i].step[s].volume, 1, sizeof(song->pattern[i].step[s].volume));
+						reader_read(ctx, &song->pattern[i].step[s].volume, 1, sizeof(song->pattern[i].step[s].volume));
 					}
 					else
 					{
@@ -2468,7 +2795,7 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 		if (version >= 12)
 		{
 			Uint8 max_wt = 0;
-			my_RWread(ctx, &max_wt, 1, sizeof(Uint8));
+			reader_read(ctx, &max_wt, 1, sizeof(Uint8));
 
 			for (int i = 0 ; i < max_wt ; ++i)
 			{
@@ -2485,8 +2812,8 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 					song->wavetable_names[i] = malloc(MUS_WAVETABLE_NAME_LEN + 1);
 					memset(song->wavetable_names[i], 0, MUS_WAVETABLE_NAME_LEN + 1);
 
-					my_RWread(ctx, &len, 1, 1);
-					my_RWread(ctx, song->wavetable_names[i], len, sizeof(char));
+					reader_read(ctx, &len, 1, 1);
+					reader_read(ctx, song->wavetable_names[i], len, sizeof(char));
 				}
 			}
 			else
@@ -2510,6 +2837,40 @@ int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_ent
 }
 
 
+int mus_load_song_RW(RWops *ctx, MusSong *song, CydWavetableEntry *wavetable_entries)
+{
+	size_t size;
+	Uint8 *data = read_stream(ctx, &size);
+
+	if (!data)
+		return 0;
+
+	Reader r;
+	reader_init_memory(&r, data, size);
+
+	int result = load_song(&r, song, wavetable_entries);
+
+	free(data);
+
+	return result;
+}
+
+
+int mus_load_song_from_memory(const void *data, int data_size, MusSong *song, CydWavetableEntry *wavetable_entries)
+{
+	Reader r;
+	reader_init_memory(&r, data, data_size);
+
+	return load_song(&r, song, wavetable_entries);
+}
+
+
+void mus_set_load_flags(Uint32 flags)
+{
+	load_flags = flags;
+}
+
+
 int mus_load_song(const char *path, MusSong *song, CydWavetableEntry *wavetable_entries)
 {
 	RWops *ctx = RWFromFile(path, "rb");
@@ -2611,79 +2972,634 @@ int mus_load_song_file(FILE *f, MusSong *song, CydWavetableEntry *wavetable_entr
 }
 
 
-Uint32 mus_get_playtime_at(MusSong *song, int position)
+/* Walks through the song like mus_advance_tick() but only follows the commands that change the timing */
+
+typedef struct
 {
-	Uint32 ticks = 0;
-	int pos = 0;
-	int seq_pos[MUS_MAX_CHANNELS] = {0}, pattern_pos[MUS_MAX_CHANNELS] = {0};
-	MusPattern *pattern[MUS_MAX_CHANNELS] = {0};
-	int spd1 = song->song_speed, spd2 = song->song_speed2, rate = song->song_rate;
+	const MusSong *song;
+	const MusPattern *pattern[MUS_MAX_CHANNELS];
+	int sequence_position[MUS_MAX_CHANNELS], pattern_step[MUS_MAX_CHANNELS];
+	int speed, speed2, rate, sample_rate;
+	MusTimeRow row; // the row about to be played
+} MusTimeScan;
 
-	while (pos < position)
-	{
-		for (int t = 0 ; t < song->num_channels ; ++t)
-		{
-			if (seq_pos[t] < song->num_sequences[t])
-			{
-				if (song->sequence[t][seq_pos[t]].position == pos)
-				{
-					if (seq_pos[t] < song->num_sequences[t])
-					{
-						pattern_pos[t] = 0;
 
-						pattern[t] = &song->pattern[song->sequence[t][seq_pos[t]].pattern];
+static void mus_time_scan_init(MusTimeScan *scan, const MusSong *song, int sample_rate)
+{
+	memset(scan, 0, sizeof(*scan));
+	scan->song = song;
+	scan->speed = song->song_speed;
+	scan->speed2 = song->song_speed2;
+	scan->rate = my_max(1, song->song_rate);
+	scan->sample_rate = sample_rate;
+}
 
-						seq_pos[t]++;
-					}
-				}
 
-				if (pattern[t] && pattern_pos[t] < pattern[t]->num_steps)
-				{
-					Uint16 command = pattern[t]->step[pattern_pos[t]].command;
+/* Advances to the next row, returns 0 if the song has ended */
 
-					if ((command & 0xff00) == MUS_FX_SET_SPEED)
-					{
-						spd1 = command & 0xf;
-						spd2 = (command & 0xf0) >> 4;
+static int mus_time_scan_row(MusTimeScan *scan)
+{
+	const MusSong *song = scan->song;
+	int position = scan->row.position;
 
-						if (!spd2)
-							spd2 = spd1;
-					}
-					else if ((command & 0xff00) == MUS_FX_SET_RATE)
-					{
-						rate = command & 0xff;
+	if (position >= song->song_length)
+		return 0;
 
-						if (rate < 1)
-							rate = 1;
-					}
-					else if ((command & 0xff00) == MUS_FX_SKIP_PATTERN)
-					{
-						pos += pattern[t]->num_steps - 1 - pattern_pos[t];
-					}
-				}
+	int period = scan->sample_rate / scan->rate;
+	int first_tick = period - 1; // cyd->callback_counter after the tick 0 callback
 
-			}
+	for (int i = 0 ; i < song->num_channels ; ++i)
+	{
+		while (scan->sequence_position[i] < song->num_sequences[i] && song->sequence[i][scan->sequence_position[i]].position <= position)
+		{
+			const MusSeqPattern *seq = &song->sequence[i][scan->sequence_position[i]];
 
-			pattern_pos[t]++;
+			scan->pattern[i] = seq->pattern < song->num_patterns ? &song->pattern[seq->pattern] : NULL;
+			scan->pattern_step[i] = position - seq->position;
+			if (scan->pattern[i] && scan->pattern_step[i] >= scan->pattern[i]->num_steps)
+				scan->pattern[i] = NULL;
+			++scan->sequence_position[i];
 		}
 
-		int spd = pos & 1 ? spd2 : spd1;
+		if (scan->pattern[i])
+		{
+			const Uint16 command = scan->pattern[i]->step[scan->pattern_step[i]].command;
+
+			// Same masks as in do_command()
 
-		ticks += (1000 * spd) / rate;
+			if ((command & 0x7f00) == MUS_FX_SET_SPEED)
+			{
+				scan->speed = command & 0xf;
+				scan->speed2 = (command & 0xf0) ? (command >> 4) & 0xf : scan->speed;
+			}
+			else if ((command & 0x7f00) == MUS_FX_SET_RATE)
+			{
+				scan->rate = my_max(1, command & 0xff);
+				period = scan->sample_rate / scan->rate;
 
-		++pos;
+				if (period > 0)
+					first_tick %= period;
+			}
+		}
 	}
 
-	return ticks;
-}
+	const int ticks = my_max(1, (position & 1) ? scan->speed2 : scan->speed);
 
+	scan->row.time += (1000 * ticks) / scan->rate;
 
-void mus_set_channel_volume(MusEngine* mus, int chan, int volume)
-{
-	MusChannel *chn = &mus->channel[chan];
-	CydChannel *cydchn = &mus->cyd->channel[chan];
+	if (period > 0)
+		scan->row.sample += first_tick + 1 + (Uint64)(ticks - 1) * period;
+
+	for (int i = 0 ; i < song->num_channels ; ++i)
+	{
+		const MusPattern *pattern = scan->pattern[i];
+
+		if (!pattern)
+			continue;
+
+		const Uint16 command = pattern->step[scan->pattern_step[i]].command;
+
+		if ((command & 0xff00) == MUS_FX_SKIP_PATTERN)
+		{
+			position += my_max(pattern->num_steps - scan->pattern_step[i] - 1, 0);
+			scan->pattern[i] = NULL;
+			scan->pattern_step[i] = 0;
+		}
+		else
+		{
+			scan->pattern_step[i] = (command & 0xff00) == MUS_FX_LOOP_PATTERN ? command & 0xff : scan->pattern_step[i] + 1;
+
+			if (scan->pattern_step[i] >= pattern->num_steps)
+			{
+				scan->pattern[i] = NULL;
+				scan->pattern_step[i] = 0;
+			}
+		}
+	}
+
+	scan->row.position = my_min(position + 1, 0xffff);
+
+	return 1;
+}
+
+
+Uint32 mus_get_playtime_at(MusSong *song, int position)
+{
+	MusTimeScan scan;
+
+	mus_time_scan_init(&scan, song, 0);
+
+	while (scan.row.position < position && mus_time_scan_row(&scan))
+		;
+
+	return scan.row.time;
+}
+
+
+int mus_build_time_index(const MusSong *song, int sample_rate, MusTimeIndex *index)
+{
+	MusTimeScan scan;
+
+	memset(index, 0, sizeof(*index));
+
+	// Every row is played at most once so this is enough for all rows and the end of the song
+	index->row = malloc(sizeof(index->row[0]) * (song->song_length + 1));
+
+	if (!index->row)
+		return 0;
+
+	index->sample_rate = sample_rate;
+
+	mus_time_scan_init(&scan, song, sample_rate);
+
+	do
+	{
+		index->row[index->num_rows++] = scan.row;
+	}
+	while (mus_time_scan_row(&scan));
+
+	return 1;
+}
+
+
+void mus_free_time_index(MusTimeIndex *index)
+{
+	free(index->row);
+	memset(index, 0, sizeof(*index));
+}
+
+
+/* The first row at or after the position */
+
+static const MusTimeRow * mus_find_time_row(const MusTimeIndex *index, int position)
+{
+	int lo = 0, hi = index->num_rows - 1;
+
+	while (lo < hi)
+	{
+		const int mid = (lo + hi) / 2;
+
+		if (index->row[mid].position < position)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return &index->row[lo];
+}
+
+
+Uint32 mus_get_indexed_playtime_at(const MusTimeIndex *index, int position)
+{
+	return index->num_rows > 0 ? mus_find_time_row(index, position)->time : 0;
+}
+
+
+Uint64 mus_get_indexed_sample_at(const MusTimeIndex *index, int position)
+{
+	return index->num_rows > 0 ? mus_find_time_row(index, position)->sample : 0;
+}
+
+
+int mus_get_position_at_time(const MusTimeIndex *index, Uint32 time)
+{
+	int lo = 0, hi = index->num_rows - 1;
+
+	// The last row that starts at or before the time
+
+	while (lo < hi)
+	{
+		const int mid = (lo + hi + 1) / 2;
+
+		if (index->row[mid].time <= time)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return index->num_rows > 0 ? index->row[lo].position : 0;
+}
+
+
+int mus_get_position_at_sample(const MusTimeIndex *index, Uint64 sample)
+{
+	int lo = 0, hi = index->num_rows - 1;
+
+	while (lo < hi)
+	{
+		const int mid = (lo + hi + 1) / 2;
+
+		if (index->row[mid].sample <= sample)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return index->num_rows > 0 ? index->row[lo].position : 0;
+}
+
+
+/* A copy of the engine for simulating playback without output. The song is copied too since
+   the speed and rate commands change it */
+
+typedef struct
+{
+	MusEngine mus;
+	CydEngine cyd;
+	MusSong song;
+} MusSimulation;
+
+
+static int mus_init_simulation(MusSimulation *sim, const MusEngine *mus, const MusSong *song)
+{
+	// The song parameters change with the speed and rate commands if the song is playing
+	cyd_lock(mus->cyd, 1);
+	sim->cyd = *mus->cyd;
+	sim->song = *song;
+	cyd_lock(mus->cyd, 0);
+
+	sim->cyd.flags |= CYD_SINGLE_THREAD; // no locking
+	sim->cyd.channel = malloc(sizeof(sim->cyd.channel[0]) * my_max(1, sim->cyd.n_channels));
+
+	if (!sim->cyd.channel)
+		return 0;
+
+	// The vibrato tables are shared with the playing engine so they are not regenerated here
+	mus_reset_engine(&sim->mus, &sim->cyd);
+	sim->mus.flags = MUS_SIMULATION;
+	mus_set_song_internal(&sim->mus, &sim->song, 0);
+
+	sim->cyd.callback_period = sim->cyd.sample_rate / my_max(1, sim->song.song_rate);
+
+	return 1;
+}
+
+
+/* Returns 0 when the song ends or loops */
+
+static int mus_simulate_tick(MusSimulation *sim)
+{
+	const Uint16 position = sim->mus.song_position;
+
+	// Same as cyd_run_callback() so that the tick length is right also when the rate changes
+	sim->cyd.callback_counter = sim->cyd.callback_period - 1;
+
+	if (!mus_advance_tick(&sim->mus))
+		return 0;
+
+	cyd_advance_envelopes(&sim->cyd, sim->cyd.callback_counter + 1);
+
+	// song_counter is zeroed only when a row ends and then the position always increases unless the song loops
+	return sim->mus.song_counter != 0 || sim->mus.song_position > position;
+}
+
+
+static void mus_save_checkpoint(const MusEngine *mus, MusCheckpoint *cp, CydChannel *cyd_channel)
+{
+	cp->song_position = mus->song_position;
+	cp->song_speed = mus->song->song_speed;
+	cp->song_speed2 = mus->song->song_speed2;
+	cp->song_rate = mus->song->song_rate;
+	cp->play_volume = mus->play_volume;
+	cp->multiplex_ctr = mus->multiplex_ctr;
+
+	for (int i = 0 ; i < MUS_MAX_CHANNELS ; ++i)
+	{
+		cp->channel[i] = mus->channel[i];
+		cp->song_track[i] = mus->song_track[i];
+	}
+
+	for (int i = 0 ; i < CYD_MAX_FX_CHANNELS ; ++i)
+		cp->crush[i] = mus->cyd->fx[i].crush;
+
+	if (cyd_channel)
+		memcpy(cyd_channel, mus->cyd->channel, sizeof(cyd_channel[0]) * mus->cyd->n_channels);
+}
+
+
+/* The song of the checkpoint must already be set. Muted channels stay muted */
+
+static void mus_load_checkpoint(MusEngine *mus, const MusCheckpoint *cp, const CydChannel *cyd_channel, int n_channels)
+{
+	const MusCompiledSong *compiled = mus->compiled && mus->compiled->song == mus->song ? mus->compiled : NULL;
+
+	mus->song_position = cp->song_position;
+	mus->song_counter = 0;
+	mus->song->song_speed = cp->song_speed;
+	mus->song->song_speed2 = cp->song_speed2;
+	mus->song->song_rate = cp->song_rate;
+	mus->play_volume = cp->play_volume;
+	mus->multiplex_ctr = cp->multiplex_ctr;
+
+	for (int i = 0 ; i < MUS_MAX_CHANNELS ; ++i)
+	{
+		const Uint32 disabled = mus->channel[i].flags & MUS_CHN_DISABLED;
+		MusTrackStatus *track_status = &mus->song_track[i];
+
+		mus->channel[i] = cp->channel[i];
+		mus->channel[i].flags = (mus->channel[i].flags & ~MUS_CHN_DISABLED) | disabled;
+
+		*track_status = cp->song_track[i];
+		track_status->rows = compiled && track_status->pattern ? compiled->rows[i][track_status->sequence_position - 1] : NULL;
+	}
+
+	for (int i = 0 ; i < CYD_MAX_FX_CHANNELS ; ++i)
+		mus->cyd->fx[i].crush = cp->crush[i];
+
+	memcpy(mus->cyd->channel, cyd_channel, sizeof(cyd_channel[0]) * my_min(n_channels, mus->cyd->n_channels));
+
+	update_all_volumes(mus);
+}
+
+
+/* Saves the engine state every interval rows while the song is played through once without output,
+   only the envelopes are advanced between ticks */
+
+int mus_build_seek_index(MusEngine *mus, MusSong *song, int interval, MusSeekIndex *index)
+{
+	MusSimulation sim;
+
+	memset(index, 0, sizeof(*index));
+
+	if (interval < 1 || !mus_init_simulation(&sim, mus, song))
+		return 0;
+
+	index->song = song;
+	index->interval = interval;
+	index->n_channels = sim.cyd.n_channels;
+
+	int allocated = 0, next = 0, ok = 1;
+
+	do
+	{
+		if (sim.mus.song_counter == 0 && sim.mus.song_position >= next && sim.mus.song_position < song->song_length)
+		{
+			if (index->num_checkpoints >= allocated)
+			{
+				allocated = my_max(16, allocated * 2);
+
+				MusCheckpoint *checkpoint = realloc(index->checkpoint, sizeof(index->checkpoint[0]) * allocated);
+
+				if (checkpoint)
+					index->checkpoint = checkpoint;
+
+				CydChannel *cyd_channel = realloc(index->cyd_channel, sizeof(index->cyd_channel[0]) * allocated * my_max(1, index->n_channels));
+
+				if (cyd_channel)
+					index->cyd_channel = cyd_channel;
+
+				if (!checkpoint || !cyd_channel)
+				{
+					ok = 0;
+					break;
+				}
+			}
+
+			mus_save_checkpoint(&sim.mus, &index->checkpoint[index->num_checkpoints], &index->cyd_channel[index->num_checkpoints * index->n_channels]);
+			++index->num_checkpoints;
+
+			next = (sim.mus.song_position / interval + 1) * interval;
+		}
+	}
+	while (mus_simulate_tick(&sim));
+
+	free(sim.cyd.channel);
+
+	if (!ok)
+	{
+		warning("Out of memory while building seek index");
+		mus_free_seek_index(index);
+		return 0;
+	}
+
+	return 1;
+}
+
+
+void mus_free_seek_index(MusSeekIndex *index)
+{
+	free(index->checkpoint);
+	free(index->cyd_channel);
+	memset(index, 0, sizeof(*index));
+}
+
+
+/* The simulation binds lazily loaded wave entries without decoding them */
+
+static void mus_unpack_bound_entries(MusEngine *mus)
+{
+#ifndef CYD_DISABLE_WAVETABLE
+	for (int i = 0 ; i < mus->cyd->n_channels ; ++i)
+	{
+		const CydChannel *cydchn = &mus->cyd->channel[i];
+
+		if (cydchn->wave_entry)
+			mus_wave_entry(mus, cydchn->wave_entry - mus->cyd->wavetable_entries);
+
+#ifndef CYD_DISABLE_FM
+		if (cydchn->fm.wave_entry)
+			mus_wave_entry(mus, cydchn->fm.wave_entry - mus->cyd->wavetable_entries);
+#endif
+	}
+#endif
+}
+
+
+/* Restores the last checkpoint before the row and simulates the rest of the way outside the lock */
+
+int mus_seek(MusEngine *mus, const MusSeekIndex *index, Uint16 position)
+{
+	MusSong *song = index->song;
+	int lo = 0, hi = index->num_checkpoints;
+
+	while (hi - lo > 1)
+	{
+		const int mid = (lo + hi) / 2;
+
+		if (index->checkpoint[mid].song_position <= position)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	MusSimulation sim;
+	int reached = 0;
+
+	if (index->num_checkpoints > 0 && index->checkpoint[lo].song_position <= position && mus_init_simulation(&sim, mus, song))
+	{
+		mus_load_checkpoint(&sim.mus, &index->checkpoint[lo], &index->cyd_channel[lo * index->n_channels], index->n_channels);
+		sim.cyd.callback_period = sim.cyd.sample_rate / my_max(1, sim.song.song_rate);
+
+		while (sim.mus.song_counter != 0 || sim.mus.song_position < position)
+		{
+			if (!mus_simulate_tick(&sim))
+				break;
+		}
+
+		reached = sim.mus.song_counter == 0 && sim.mus.song_position == position;
+
+		if (reached)
+		{
+			MusCheckpoint state;
+			mus_save_checkpoint(&sim.mus, &state, NULL);
+
+			// The compiled song is kept if it is for the same song. A posted song can replace it
+			// on the audio thread so it is only looked at with the lock held
+
+			cyd_lock(mus->cyd, 1);
+			const int replace = !(mus->compiled && mus->compiled->song == song);
+			cyd_lock(mus->cyd, 0);
+
+			MusCompiledSong *compiled = replace && (mus->flags & MUS_COMPILE_SONG) ? mus_compile_song(song) : NULL;
+			MusCompiledSong *old = NULL;
+
+			cyd_set_callback_rate(mus->cyd, state.song_rate);
+
+			cyd_lock(mus->cyd, 1);
+
+			if (!(mus->compiled && mus->compiled->song == song))
+			{
+				old = mus->compiled;
+				mus->compiled = compiled;
+				compiled = NULL;
+			}
+
+			mus->song = song;
+#ifndef CYD_DISABLE_INACCURACY
+			mus->pitch_mask = (~0) << song->pitch_inaccuracy;
+#endif
+			mus_load_checkpoint(mus, &state, sim.cyd.channel, sim.cyd.n_channels);
+			mus_unpack_bound_entries(mus);
+
+			cyd_lock(mus->cyd, 0);
+
+			mus_free_compiled_song(old);
+			mus_free_compiled_song(compiled);
+			mus_free_retired_song(mus);
+		}
+
+		free(sim.cyd.channel);
+	}
+
+	if (!reached)
+		mus_set_song(mus, song, position);
+
+	return reached;
+}
+
+
+void mus_set_channel_volume(MusEngine* mus, int chan, int volume)
+{
+	MusChannel *chn = &mus->channel[chan];
+	CydChannel *cydchn = &mus->cyd->channel[chan];
 	MusTrackStatus *track_status = &mus->song_track[chan];
 
 	chn->volume = my_min(volume, MAX_VOLUME);
 	update_volumes(mus, track_status, chn, cydchn, track_status->volume);
 }
+
+
+/* Lock-free variants of the above, the calls are queued and run by the audio thread before the next block.
+   Only one thread may post commands. Instruments and songs must stay valid until the command has run */
+
+static void mus_command_trigger_instrument(void *context, const CydCommand *command)
+{
+	mus_trigger_instrument_internal(context, command->chan, command->ptr, command->param[0], command->param[1]);
+}
+
+
+static void mus_command_release(void *context, const CydCommand *command)
+{
+	MusEngine *mus = context;
+	cyd_enable_gate(mus->cyd, &mus->cyd->channel[command->chan], 0);
+}
+
+
+static void mus_command_set_channel_volume(void *context, const CydCommand *command)
+{
+	mus_set_channel_volume(context, command->chan, command->param[0]);
+}
+
+
+#ifdef STEREOOUTPUT
+static void mus_command_set_panning(void *context, const CydCommand *command)
+{
+	MusEngine *mus = context;
+	cyd_set_panning(mus->cyd, &mus->cyd->channel[command->chan], command->param[0]);
+}
+#endif
+
+
+/* The replaced compiled song is handed back to the posting thread, or freed here if the last one
+   has not been collected yet */
+
+static void mus_command_set_song(void *context, const CydCommand *command)
+{
+	MusEngine *mus = context;
+	MusCompiledSong *old = mus->compiled;
+
+	mus->compiled = command->param[1] ? command->ptr : NULL;
+	mus_set_song_internal(mus, command->param[1] ? (MusSong *)mus->compiled->song : command->ptr, command->param[0]);
+
+	if (old)
+	{
+		if (!cyd_load_acquire(&mus->retired))
+			cyd_store_release(&mus->retired, old);
+		else
+			mus_free_compiled_song(old);
+	}
+}
+
+
+static int mus_post(MusEngine *mus, void (*execute)(void *, const CydCommand *), int chan, void *ptr, int param0, int param1)
+{
+	CydCommand command = { execute, mus, chan, { param0, param1, 0 }, ptr };
+	return cyd_post_command(mus->cyd, &command);
+}
+
+
+int mus_post_trigger_instrument(MusEngine* mus, int chan, MusInstrument *ins, Uint16 note, int panning)
+{
+	return mus_post(mus, mus_command_trigger_instrument, chan, ins, note, panning);
+}
+
+
+int mus_post_release(MusEngine* mus, int chan)
+{
+	return mus_post(mus, mus_command_release, chan, NULL, 0, 0);
+}
+
+
+int mus_post_channel_volume(MusEngine* mus, int chan, int volume)
+{
+	return mus_post(mus, mus_command_set_channel_volume, chan, NULL, volume, 0);
+}
+
+
+#ifdef STEREOOUTPUT
+int mus_post_panning(MusEngine* mus, int chan, int panning)
+{
+	return mus_post(mus, mus_command_set_panning, chan, NULL, panning, 0);
+}
+#endif
+
+
+/* The song is compiled here so that the audio thread never uses the rows of a previous song */
+
+int mus_post_song(MusEngine *mus, MusSong *song, Uint16 position)
+{
+	mus_free_retired_song(mus);
+
+	MusCompiledSong *compiled = song && (mus->flags & MUS_COMPILE_SONG) ? mus_compile_song(song) : NULL;
+
+	if (compiled)
+	{
+		if (mus_post(mus, mus_command_set_song, 0, compiled, position, 1))
+			return 1;
+
+		mus_free_compiled_song(compiled);
+		return 0;
+	}
+
+	return mus_post(mus, mus_command_set_song, 0, song, position, 0);
+}
@@ -158,9 +158,13 @@ typedef struct
 } MusSong;
 
 
+typedef struct MusRow_t MusRow;
+typedef struct MusCompiledSong_t MusCompiledSong;
+
 typedef struct
 {
 	MusPattern *pattern;
+	const MusRow *rows; // the pattern decoded by mus_set_song(), see MUS_COMPILE_SONG
 	Uint8 last_ctrl;
 	Uint16 pw, pattern_step, sequence_position, slide_speed;
 	Uint16 vibrato_position, pwm_position;
@@ -188,8 +192,45 @@ typedef struct
 	Uint32 flags;
 	Uint32 ext_sync_ticks;
 	Uint32 pitch_mask;
+	MusCompiledSong *compiled;
+	MusCompiledSong * volatile retired; // replaced by a posted song on the audio thread, freed by the posting thread
 } MusEngine;
 
+/* Engine state at the start of a row, see mus_build_seek_index() */
+typedef struct
+{
+	Uint16 song_position;
+	Uint8 song_speed, song_speed2, song_rate;
+	Uint8 play_volume, multiplex_ctr;
+	MusChannel channel[MUS_MAX_CHANNELS];
+	MusTrackStatus song_track[MUS_MAX_CHANNELS];
+	CydCrush crush[CYD_MAX_FX_CHANNELS];
+} MusCheckpoint;
+
+typedef struct
+{
+	MusSong *song;
+	int interval; // rows between checkpoints
+	int num_checkpoints, n_channels;
+	MusCheckpoint *checkpoint;
+	CydChannel *cyd_channel; // n_channels per checkpoint
+} MusSeekIndex;
+
+typedef struct
+{
+	Uint16 position;
+	Uint32 time; // milliseconds from the start of the song, same as mus_get_playtime_at()
+	Uint64 sample; // samples from the start of the song
+} MusTimeRow;
+
+/* Start times of the rows played during one pass of the song, see mus_build_time_index() */
+typedef struct
+{
+	int sample_rate;
+	int num_rows; // the last row is the end of the song
+	MusTimeRow *row;
+} MusTimeIndex;
+
 
 enum
 {
@@ -216,7 +257,8 @@ enum
 
 enum
 {
-	MUS_EXT_SYNC = 1
+	MUS_EXT_SYNC = 1,
+	MUS_COMPILE_SONG = 2 // decode the song once in mus_set_song() or mus_post_song(), the song must not be edited while it plays
 };
 
 #define MUS_NOTE_VOLUME_SET_PAN 0xa0
@@ -313,6 +355,13 @@ enum
 	MUS_NO_REPEAT = 8
 };
 
+/* Loader options, see mus_set_load_flags() */
+enum
+{
+	MUS_LOAD_LAZY_WAVETABLE = 1, // keep compressed samples packed until an instrument or command first uses them
+	MUS_LOAD_WAVETABLE_MIPS = 2 // build the mip levels for high notes, see cyd_wave_entry_build_mips(). Not done for lazy samples
+};
+
 enum
 {
 	MUS_SHAPE_SINE,
@@ -364,7 +413,9 @@ int mus_load_instrument(const char *path, MusInstrument *inst, CydWavetableEntry
 void mus_get_default_instrument(MusInstrument *inst);
 int mus_load_song(const char *path, MusSong *song, CydWavetableEntry *wavetable_entries);
 int mus_load_song_file(FILE *f, MusSong *song, CydWavetableEntry *wavetable_entries);
-int mus_load_song_RW(RWops *rw, MusSong *song, CydWavetableEntry *wavetable_entries);
+int mus_load_song_RW(RWops *rw, MusSong *song, CydWavetableEntry *wavetable_entries); // reads the stream to the end
+int mus_load_song_from_memory(const void *data, int data_size, MusSong *song, CydWavetableEntry *wavetable_entries);
+void mus_set_load_flags(Uint32 flags); // applies to all following song and instrument loads
 int mus_load_fx_RW(RWops *ctx, CydFxSerialized *fx);
 int mus_load_fx_file(FILE *f, CydFxSerialized *fx);
 int mus_load_fx(const char *path, CydFxSerialized *fx);
@@ -373,4 +424,29 @@ void mus_set_fx(MusEngine *mus, MusSong *song);
 Uint32 mus_ext_sync(MusEngine *mus);
 Uint32 mus_get_playtime_at(MusSong *song, int position);
 
+/* Seeking that keeps the instruments, volumes, filters etc. set by the earlier rows. The index is built by
+   simulating the song with the engine settings (sample rate, channels) of mus and must be rebuilt if the
+   song is edited. mus_seek() returns 0 if the row is never reached and does the same as mus_set_song() then */
+int mus_build_seek_index(MusEngine *mus, MusSong *song, int interval, MusSeekIndex *index);
+void mus_free_seek_index(MusSeekIndex *index);
+int mus_seek(MusEngine *mus, const MusSeekIndex *index, Uint16 position);
+
+/* Row <-> time lookups with binary search. The index must be rebuilt if the song is edited. A row jumped over
+   by a skip pattern command gets the time of the next row played, a time or sample maps to the row playing then */
+int mus_build_time_index(const MusSong *song, int sample_rate, MusTimeIndex *index);
+void mus_free_time_index(MusTimeIndex *index);
+Uint32 mus_get_indexed_playtime_at(const MusTimeIndex *index, int position);
+Uint64 mus_get_indexed_sample_at(const MusTimeIndex *index, int position);
+int mus_get_position_at_time(const MusTimeIndex *index, Uint32 time);
+int mus_get_position_at_sample(const MusTimeIndex *index, Uint64 sample);
+
+/* Queue the call for the audio thread instead of locking, return 0 if the queue is full */
+int mus_post_trigger_instrument(MusEngine* mus, int chan, MusInstrument *ins, Uint16 note, int panning);
+int mus_post_release(MusEngine* mus, int chan);
+int mus_post_channel_volume(MusEngine* mus, int chan, int volume);
+#ifdef STEREOOUTPUT
+int mus_post_panning(MusEngine* mus, int chan, int panning);
+#endif
+int mus_post_song(MusEngine *mus, MusSong *song, Uint16 position);
+
 #endif
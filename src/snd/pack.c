@@ -27,6 +27,7 @@ OTHER DEALINGS IN THE SOFTWARE.
 // note: compression code added for convenience (and klystrack)
 
 #include "pack.h"
+#include "macros.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -41,74 +42,90 @@ enum
 };
 
 
-/* bitstream writer helpers*/
+/* bitstream writer, bits are collected in a 64-bit buffer and stored a byte at a time */
 typedef struct
 {
 	Uint8 *buffer;
-	Uint32 byte, size_byte; 	// Read/write position counters (byte component)
-	Uint8 bit, size_bit;		// Read/write position counters (bit component)
-} BitPtr;
+	Uint32 capacity; 	// bytes allocated
+	Uint32 byte; 		// where the buffered bits go
+	Uint64 bits;
+	int count; 			// number of buffered bits
+} BitWriter;
 
 
-#define BIT_BLOCK_SIZE 1024
-
-static void bit_init(BitPtr *p, Uint8 *buffer, Uint32 size_bytes, Uint8 size_bits)
+static void bw_init(BitWriter *w)
 {
-	memset(p, 0, sizeof(*p));
-	p->buffer = buffer;
-	p->size_byte = size_bytes;
-	p->size_bit = size_bits;
+	memset(w, 0, sizeof(*w));
 }
 
 
-static void bit_seek(BitPtr *p, Uint32 byte, Uint8 bit)
+static void bw_reserve(BitWriter *w, Uint32 bytes)
 {
-	p->byte = byte;
-	p->bit = bit;
+	if (bytes > w->capacity)
+	{
+		Uint32 capacity = my_max(1024, w->capacity * 2);
+		
+		while (capacity < bytes)
+			capacity *= 2;
+		
+		w->buffer = realloc(w->buffer, capacity);
+		memset(w->buffer + w->capacity, 0, capacity - w->capacity);
+		w->capacity = capacity;
+	}
 }
 
 
-static void bit_w(BitPtr *p, int bit)
+static inline void bw_flush(BitWriter *w)
 {
-	if (p->bit == 0 && !(p->byte & (BIT_BLOCK_SIZE - 1)))
+	bw_reserve(w, w->byte + w->count / 8 + 1);
+	
+	while (w->count >= 8)
 	{
-		p->buffer = realloc(p->buffer, p->byte + BIT_BLOCK_SIZE);
+		w->buffer[w->byte++] = w->bits;
+		w->bits >>= 8;
+		w->count -= 8;
 	}
+}
 
-	if (bit)
-		p->buffer[p->byte] |= 1 << p->bit;
-	else
-		p->buffer[p->byte] &= ~(1 << p->bit);
 
-	++p->bit;
+/* Write the last partial byte without touching the bits after it (needed by bw_seek()) */
+static void bw_flush_all(BitWriter *w)
+{
+	bw_flush(w);
 	
-	if (p->bit == 8)
+	if (w->count > 0)
 	{
-		p->bit = 0;
-		++p->byte;
+		const Uint8 mask = (1 << w->count) - 1;
+		w->buffer[w->byte] = (w->buffer[w->byte] & ~mask) | (w->bits & mask);
 	}
-	
-	p->size_byte = p->byte;
-	p->size_bit = p->bit;
 }
 
 
-static int bit_r(BitPtr *p)
+static inline Uint32 bw_tell(const BitWriter *w)
 {
-	if (p->size_byte <= p->byte && p->size_bit <= p->bit)
-		return -1;
+	return w->byte * 8 + w->count;
+}
 
-	int bit = (p->buffer[p->byte] & (1 << p->bit)) != 0;
-	
-	++p->bit;
+
+/* Continue writing from an earlier position, the data after it is kept until overwritten */
+static void bw_seek(BitWriter *w, Uint32 position)
+{
+	bw_flush_all(w);
 	
-	if (p->bit == 8)
-	{
-		p->bit = 0;
-		++p->byte;
-	}
+	w->byte = position / 8;
+	w->count = position & 7;
+	w->bits = w->count ? w->buffer[w->byte] & ((1 << w->count) - 1) : 0;
+}
+
+
+/* Write bits (at most 32) bits of v */
+static inline void bw_bits(BitWriter *w, Uint32 v, int bits)
+{
+	w->bits |= (Uint64)(v & (Uint32)(((Uint64)1 << bits) - 1)) << w->count;
+	w->count += bits;
 	
-	return bit;
+	if (w->count >= 32)
+		bw_flush(w);
 }
 
 
@@ -134,72 +151,318 @@ static int log2u(Uint32 v)
 
 
 /* Write Elias gamma coded value (has to be nonzero) */
-static void bit_wgamma(BitPtr *p, Uint32 value)
+static void bw_gamma(BitWriter *w, Uint32 value)
 {
 	int l = log2u(value);
 	
-	for (int a=0; a < l; a++)
-		bit_w(p, 0); //put 0s to indicate how many bits will follow
-		
-	bit_w(p, 1);      //mark the end of the 0s
+	bw_bits(w, 1u << l, l + 1); // l zeros to indicate how many bits will follow and a one to mark the end
 	
-	for (int a=l-1; a >= 0; a--) //Write the bits as plain binary
-	{
-		bit_w(p, value & 1 << a);
-	}
+	// The bits as plain binary, most significant first
 	
+	Uint32 reversed = 0;
+	
+	for (int a = 0 ; a < l ; ++a)
+		reversed |= ((value >> a) & 1) << (l - 1 - a);
+		
+	bw_bits(w, reversed, l);
 }
 
 
-/* Read Elias gamma coded value, zero return value signals read error */
-static Uint32 bit_rgamma(BitPtr *p)
+/* Length of the Elias gamma code of value */
+static inline Uint32 gamma_length(Uint32 value)
 {
-	int numberBits = 0;
-	int bit;
-	while (!(bit = bit_r(p)))
-		numberBits++; //keep on reading until we fetch a one...
-	
-	if (bit < 0) return 0;
-		
-	Uint32 current = 0;
-	for (int a=numberBits-1; a >= 0; a--) //Read numberBits bits
+	return log2u(value) * 2 + 1;
+}
+
+
+/* bitstream reader, keeps up to 64 bits buffered so that most reads need no refill */
+typedef struct
+{
+	const Uint8 *ptr, *end;
+	Uint64 buffer;
+	int count; 			// bits in buffer
+	Uint32 left; 		// bits left in the stream, including the buffered ones
+} BitReader;
+
+
+#define GAMMA_TABLE_BITS 11
+
+/* Elias gamma codes that fit in GAMMA_TABLE_BITS bits, indexed by the next bits in the stream:
+   the number of trailing zeros gives the code length, the bits after the first one are the
+   value below its leading one, least significant first */
+static const struct
+{
+	Uint16 value;
+	Uint8 length; // zero if the code is longer
+} gamma_table[1 << GAMMA_TABLE_BITS] =
+{
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{16,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{32,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{24,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{20,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{48,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{28,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{18,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{40,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{26,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{22,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{56,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{30,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{17,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{36,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{25,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{21,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{52,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{29,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{19,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{44,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{27,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{23,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{60,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{31,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{16,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{34,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{24,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{20,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{50,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{28,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{18,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{42,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{26,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{22,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{58,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{30,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{17,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{38,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{25,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{21,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{54,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{29,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{19,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{46,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{27,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{23,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{62,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{31,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{16,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{33,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{24,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{20,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{49,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{28,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{18,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{41,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{26,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{22,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{57,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{30,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{17,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{37,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{25,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{21,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{53,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{29,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{19,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{45,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{27,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{23,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{61,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{31,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{16,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{35,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{24,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{20,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{51,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{28,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{18,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{43,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{26,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{22,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{59,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{30,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{17,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{39,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{25,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{21,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{55,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{29,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {8,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{19,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {12,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{47,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {10,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{27,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {14,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{0,0}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {9,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{23,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {13,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1},
+	{63,11}, {1,1}, {2,3}, {1,1}, {4,5}, {1,1}, {3,3}, {1,1}, {11,7}, {1,1}, {2,3}, {1,1}, {6,5}, {1,1}, {3,3}, {1,1},
+	{31,9}, {1,1}, {2,3}, {1,1}, {5,5}, {1,1}, {3,3}, {1,1}, {15,7}, {1,1}, {2,3}, {1,1}, {7,5}, {1,1}, {3,3}, {1,1}
+};
+
+
+static void br_init(BitReader *r, const Uint8 *data, Uint32 size_bits)
+{
+	r->ptr = data;
+	r->end = data + (size_bits + 7) / 8;
+	r->buffer = 0;
+	r->count = 0;
+	r->left = size_bits;
+}
+
+
+static inline void br_refill(BitReader *r)
+{
+	if (r->end - r->ptr >= 8)
 	{
-		if ((bit = bit_r(p)))
-			current |= 1 << a;
+		Uint64 word = 0;
+		
+		for (int i = 0 ; i < 8 ; ++i)
+			word |= (Uint64)r->ptr[i] << (i * 8);
 			
-		if (bit < 0) return 0;
+		r->buffer |= word << r->count;
+		r->ptr += (63 - r->count) >> 3;
+		r->count |= 56;
+	}
+	else
+	{
+		while (r->count < 56 && r->ptr < r->end)
+		{
+			r->buffer |= (Uint64)*r->ptr++ << r->count;
+			r->count += 8;
+		}
 	}
-	current |= 1 << numberBits; //last bit isn't encoded!
-	
-	return current;
 }
 
 
-/* Read bits bits */
-static Sint32 bit_rbits(BitPtr *p, Uint8 bits)
+static inline void br_skip(BitReader *r, int bits)
 {
-	Sint32 rval = 0;
+	r->buffer >>= bits;
+	r->count -= bits;
+	r->left -= bits;
+}
+
 
-	for (int i = 0 ; i < bits ; ++i)
+/* Read bits (at most 32) bits, negative return value signals read error */
+static inline Sint64 br_bits(BitReader *r, int bits)
+{
+	if (r->left < bits)
+		return -1;
+	
+	if (r->count < bits)
+		br_refill(r);
+	
+	Sint64 value = r->buffer & (((Uint64)1 << bits) - 1);
+	br_skip(r, bits);
+	
+	return value;
+}
+
+
+static inline int br_ctz(Uint64 v)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(v);
+#else
+	int n = 0;
+	
+	while (!(v & 1))
 	{
-		int bit = bit_r(p);
-		
-		if (bit < 0) return -1;
-		
-		rval |= bit << i;
+		v >>= 1;
+		++n;
 	}
 	
-	return rval;
+	return n;
+#endif
 }
 
 
-/* Write bits bits of v */
-static void bit_wbits(BitPtr *p, Uint32 v, Uint8 bits)
+/* Read Elias gamma coded value, zero return value signals read error */
+static Uint32 br_gamma(BitReader *r)
 {
-	for (int i = 0 ; i < bits ; ++i)
+	if (r->count < GAMMA_TABLE_BITS)
+		br_refill(r);
+	
+	const int peek = r->buffer & ((1 << GAMMA_TABLE_BITS) - 1);
+	
+	if (gamma_table[peek].length)
 	{
-		bit_w(p, v & (1 << i));
+		if (r->left < gamma_table[peek].length)
+			return 0;
+		
+		br_skip(r, gamma_table[peek].length);
+		
+		return gamma_table[peek].value;
 	}
+	
+	// Long code, count the zeros and read the value bits (most significant first)
+	
+	int zeros = 0;
+	
+	while (1)
+	{
+		if (r->count == 0)
+			br_refill(r);
+		
+		const int valid = my_min(r->count, r->left);
+		
+		if (valid <= 0)
+			return 0;
+		
+		const Uint64 bits = valid < 64 ? r->buffer & (((Uint64)1 << valid) - 1) : r->buffer;
+		
+		if (bits)
+		{
+			const int z = br_ctz(bits);
+			zeros += z;
+			br_skip(r, z + 1);
+			break;
+		}
+		
+		zeros += valid;
+		br_skip(r, valid);
+	}
+	
+	if (zeros > 31)
+		return 0;
+	
+	Sint64 bits = br_bits(r, zeros);
+	
+	if (bits < 0)
+		return 0;
+	
+	Uint32 current = 1;
+	
+	for (int a = 0 ; a < zeros ; ++a)
+		current = (current << 1) | ((bits >> a) & 1);
+	
+	return current;
 }
 
 
@@ -261,8 +524,8 @@ static void delta_decode(Sint16 *buffer, const int n)
 /* Compress 16-bit signed data into bitstream, return compressed data size in packed_size (in bits) */
 Uint8 * bitpack(const Sint16 *_buffer, const int n, int flags, Uint32 *packed_size)
 {
-	BitPtr bp;
-	bit_init(&bp, NULL, 0, 0);
+	BitWriter bw;
+	bw_init(&bw);
 	
 	Sint16 *buffer = malloc(sizeof(Sint16) * n);
 	memcpy(buffer, _buffer, sizeof(Sint16) * n);
@@ -285,18 +548,25 @@ Uint8 * bitpack(const Sint16 *_buffer, const int n, int flags, Uint32 *packed_si
 				break;
 			}
 			
-		Uint32 p_byte = bp.byte;
-		Uint32 p_bit = bp.bit;
+		const Uint32 start = bw_tell(&bw);
 		
 again:
 		
-		bit_wbits(&bp, type, 2);
+		bw_bits(&bw, type, 2);
 			
 		switch (type)
 		{
 			case BITPACK_LITERAL:
-				for (int i = 0 ; i < n ; ++i)
-					bit_w(&bp, buffer[i] & mask);
+				for (int i = 0 ; i < n ; )
+				{
+					const int c = my_min(32, n - i);
+					Uint32 v = 0;
+					
+					for (int b = 0 ; b < c ; ++b, ++i)
+						v |= (Uint32)((buffer[i] & mask) != 0) << b;
+					
+					bw_bits(&bw, v, c);
+				}
 				break;
 			
 			case BITPACK_STATIC0:			
@@ -307,7 +577,7 @@ again:
 			case BITPACK_RLE:
 			{
 				// Write starting bit state
-				bit_w(&bp, bit);
+				bw_bits(&bw, bit != 0, 1);
 				
 				Uint32 ctr = 0;
 				
@@ -318,7 +588,7 @@ again:
 						
 					if ((buffer[i] & mask) != bit)
 					{
-						bit_wgamma(&bp, ctr);
+						bw_gamma(&bw, ctr);
 
 						ctr = 1;
 						
@@ -327,12 +597,12 @@ again:
 					}
 				}
 				
-				if (ctr != 0) bit_wgamma(&bp, ctr);
+				if (ctr != 0) bw_gamma(&bw, ctr);
 				
-				if ((bp.byte * 8 + bp.bit) - (p_byte * 8 + p_bit) > n + 2)
+				if (bw_tell(&bw) - start > n + 2)
 				{
 					// RLE gave longer data than the original, dump data instead
-					bit_seek(&bp, p_byte, p_bit);
+					bw_seek(&bw, start);
 					type = BITPACK_LITERAL;
 					goto again;
 				}
@@ -345,9 +615,65 @@ again:
 	
 	free(buffer);
 	
-	*packed_size = bp.byte * 8 + bp.bit;
+	*packed_size = bw_tell(&bw);
+	bw_flush_all(&bw);
+	
+	return bw.buffer;
+}
+
+
+/* Size in bits bitpack() would output, the run lengths of all bitplanes are collected in one pass */
+static Uint32 bitpack_size(const Sint16 *_buffer, const int n, int flags)
+{
+	Sint16 *buffer = malloc(sizeof(Sint16) * n);
+	memcpy(buffer, _buffer, sizeof(Sint16) * n);
+	
+	if (flags & BITPACK_OPT_DELTA) delta_encode(buffer, n);
+	if (flags & BITPACK_OPT_GRAY) gray_encode(buffer, n);
+	
+	const int planes = sizeof(*buffer) * 8;
+	int run_start[16] = {0};
+	Uint32 run_bits[16] = {0};
+	Uint16 changed = 0;
+	
+	for (int i = 1 ; i < n ; ++i)
+	{
+		Uint16 flips = buffer[i] ^ buffer[i - 1];
+		
+		changed |= flips;
+		
+		while (flips)
+		{
+			const int plane = br_ctz(flips);
+			
+			run_bits[plane] += gamma_length(i - run_start[plane]);
+			run_start[plane] = i;
+			
+			flips &= flips - 1;
+		}
+	}
+	
+	free(buffer);
+	
+	Uint32 size = 0;
+	
+	for (int plane = 0 ; plane < planes ; ++plane)
+	{
+		if (!(changed & (1 << plane)))
+		{
+			// BITPACK_STATIC0 or BITPACK_STATIC1
+			size += 2;
+		}
+		else
+		{
+			const Uint32 rle = 2 + 1 + run_bits[plane] + gamma_length(n - run_start[plane]);
+			
+			// Same rule as in bitpack()
+			size += rle > n + 2 ? n + 2 : rle;
+		}
+	}
 	
-	return bp.buffer;
+	return size;
 }
 
 
@@ -356,8 +682,9 @@ again:
  */
 Sint16 * bitunpack(const Uint8 *packed_data, const Uint32 packed_size, Uint32 unpacked_size, int flags)
 {
-	BitPtr bp;
-	bit_init(&bp, (Uint8*)packed_data, packed_size / 8, packed_size & 7);
+	
+	BitReader br;
+	br_init(&br, packed_data, packed_size);
 	
 	Sint16 *buffer = calloc(unpacked_size, sizeof(Sint16));
 	
@@ -365,18 +692,22 @@ Sint16 * bitunpack(const Uint8 *packed_data, const Uint32 packed_size, Uint32 un
 	{
 		const Sint16 mask = 1 << plane;
 		
-		Sint32 type = bit_rbits(&bp, 2);
+		Sint64 type = br_bits(&br, 2);
 		
 		if (type < 0) goto read_error;
 			
 		switch (type)
 		{
 			case BITPACK_LITERAL:
-				for (int i = 0 ; i < unpacked_size ; ++i)
+				for (Uint32 i = 0 ; i < unpacked_size ; )
 				{
-					int bit = bit_r(&bp);
-					if (bit < 0) goto read_error;
-					if (bit) buffer[i] |= mask;
+					const int n = my_min(32, unpacked_size - i);
+					Sint64 bits = br_bits(&br, n);
+					
+					if (bits < 0) goto read_error;
+					
+					for (int b = 0 ; b < n ; ++b, ++i)
+						buffer[i] |= -(Sint16)((bits >> b) & 1) & mask;
 				}
 				break;
 				
@@ -386,34 +717,36 @@ Sint16 * bitunpack(const Uint8 *packed_data, const Uint32 packed_size, Uint32 un
 				
 			case BITPACK_STATIC1:
 				// Fill bitplane with set/unset bit
-				for (int i = 0 ; i < unpacked_size ; ++i)
+				for (Uint32 i = 0 ; i < unpacked_size ; ++i)
 					buffer[i] |= mask;
 				break;
 				
 			case BITPACK_RLE:
 			{
 				// Read the starting bit status
-				int bit = bit_r(&bp);
+				Sint64 bit = br_bits(&br, 1);
 				
 				if (bit < 0) goto read_error;
 				
-				if (bit) bit = mask; else bit = 0;
-				
-				buffer[0] |= bit;
-				
-				for (int i = 0 ; i < unpacked_size ; )
+				for (Uint32 i = 0 ; i < unpacked_size ; )
 				{
-					Uint32 ctr = bit_rgamma(&bp);
+					Uint32 ctr = br_gamma(&br);
 					
-					if (ctr == 0) goto read_error;
+					if (ctr == 0 || ctr > unpacked_size - i) goto read_error;
 					
-					for (; i < unpacked_size && ctr ; ++i, --ctr)
-						buffer[i] |= bit;
+					// Only runs of ones need to be written
+					if (bit)
+					{
+						Sint16 *run = buffer + i;
+						
+						for (Uint32 c = 0 ; c < ctr ; ++c)
+							run[c] |= mask;
+					}
 					
-					if (ctr) goto read_error;
+					i += ctr;
 					
 					// Flip the bit (neighboring bits are always different)
-					bit ^= mask;
+					bit ^= 1;
 				}
 			}		
 			break;
@@ -437,28 +770,360 @@ read_error:
 /* Compress with best combination of options */
 Uint8 * bitpack_best(const Sint16 *data, Uint32 data_size, Uint32 *_packed_size, int *flags)
 {
+	// The sizes are exact so only the winner needs to be actually packed
+	
 	Uint32 best_packed_size = 0;
-	Uint8 *best = NULL;
 	int best_flags = 0;
 	
 	for (int i = 0 ; i < 4 ; ++i)
 	{
-		Uint32 packed_size;
+		Uint32 packed_size = bitpack_size(data, data_size, i);
 		
-		Uint8 * cdata = bitpack(data, data_size, i, &packed_size);
-		
-		if (best == NULL || best_packed_size > packed_size)
+		if (i == 0 || best_packed_size > packed_size)
 		{
 			best_packed_size = packed_size;
-			best = cdata;
 			best_flags = i;
 		}
-		else
-			free(cdata);
 	}
 	
-	*_packed_size = best_packed_size;
 	*flags = best_flags;
 	
-	return best;
+	return bitpack(data, data_size, best_flags, _packed_size);
+}
+
+
+/* Linear prediction + Rice coding
+
+	The data is split in frames of LPC_FRAME_SAMPLES samples that can be decoded independently,
+	the packed data starts with a table of 32-bit byte offsets to each frame. A frame contains:
+	
+	- predictor order (2 bits)
+	- the first order samples verbatim (16 bits each)
+	- for each LPC_PARTITION_SAMPLES samples, the Rice parameter k (LPC_K_BITS bits) followed
+	  by the prediction residuals of the partition, k == LPC_K_ZERO means all residuals are zero
+	  and none are stored
+	
+	Residuals are zigzag coded and then written as q = residual >> k zeros, a one and the low k bits.
+	If q would be LPC_RICE_ESCAPE or more, LPC_RICE_ESCAPE zeros and LPC_RAW_BITS bits of the
+	residual are written instead. Frames are padded to a byte boundary.
+ */
+
+#define LPC_FRAME_SAMPLES 4096
+#define LPC_PARTITION_SAMPLES 256
+#define LPC_MAX_ORDER 3
+#define LPC_K_BITS 5
+#define LPC_K_ZERO ((1 << LPC_K_BITS) - 1)
+#define LPC_RICE_ESCAPE 16
+#define LPC_RAW_BITS 19 // enough for any residual of 16-bit data with the predictors below
+#define LPC_MAX_CODE_BITS (LPC_RICE_ESCAPE + LPC_RAW_BITS)
+
+/* Fixed polynomial predictors, prediction = c[0] * x[n-1] + c[1] * x[n-2] + c[2] * x[n-3] */
+static const int lpc_coeffs[LPC_MAX_ORDER + 1][LPC_MAX_ORDER] =
+{
+	{ 0, 0, 0 },
+	{ 1, 0, 0 },
+	{ 2, -1, 0 },
+	{ 3, -3, 1 }
+};
+
+
+static inline Sint32 lpc_predict(const int *c, Sint32 x1, Sint32 x2, Sint32 x3)
+{
+	return c[0] * x1 + c[1] * x2 + c[2] * x3;
+}
+
+
+static inline Uint32 zigzag(Sint32 v)
+{
+	return ((Uint32)v << 1) ^ (Uint32)(v >> 31);
+}
+
+
+static inline Sint32 unzigzag(Uint32 v)
+{
+	return (Sint32)(v >> 1) ^ -(Sint32)(v & 1);
+}
+
+
+/* Residuals for samples order..n-1 of a frame, returns their sum for comparing the predictors */
+static Uint64 lpc_residuals(const Sint16 *x, int n, int order, Uint32 *residual)
+{
+	const int *c = lpc_coeffs[order];
+	Uint64 sum = 0;
+	
+	for (int i = order ; i < n ; ++i)
+	{
+		const Sint32 x1 = i >= 1 ? x[i - 1] : 0;
+		const Sint32 x2 = i >= 2 ? x[i - 2] : 0;
+		const Sint32 x3 = i >= 3 ? x[i - 3] : 0;
+		
+		residual[i] = zigzag(x[i] - lpc_predict(c, x1, x2, x3));
+		sum += residual[i];
+	}
+	
+	return sum;
+}
+
+
+static inline Uint32 rice_length(Uint32 value, int k)
+{
+	const Uint32 q = value >> k;
+	return q < LPC_RICE_ESCAPE ? q + 1 + k : LPC_MAX_CODE_BITS;
+}
+
+
+static int rice_best_k(const Uint32 *residual, int n)
+{
+	Uint32 best_length = 0;
+	int best_k = 0;
+	Uint32 any = 0;
+	
+	for (int i = 0 ; i < n ; ++i)
+		any |= residual[i];
+	
+	if (!any)
+		return LPC_K_ZERO;
+	
+	for (int k = 0 ; k < LPC_RAW_BITS ; ++k)
+	{
+		Uint32 length = 0;
+		
+		for (int i = 0 ; i < n ; ++i)
+			length += rice_length(residual[i], k);
+			
+		if (k == 0 || length < best_length)
+		{
+			best_length = length;
+			best_k = k;
+		}
+	}
+	
+	return best_k;
+}
+
+
+static void bw_rice(BitWriter *w, Uint32 value, int k)
+{
+	const Uint32 q = value >> k;
+	
+	if (q < LPC_RICE_ESCAPE)
+	{
+		bw_bits(w, 1u << q, q + 1);
+		bw_bits(w, value, k);
+	}
+	else
+	{
+		bw_bits(w, 0, LPC_RICE_ESCAPE);
+		bw_bits(w, value, LPC_RAW_BITS);
+	}
+}
+
+
+/* Compress 16-bit signed data with linear prediction, packed_size is in bits like with bitpack() */
+Uint8 * lpcpack(const Sint16 *data, const Uint32 n, Uint32 *packed_size)
+{
+	const Uint32 frames = (n + LPC_FRAME_SAMPLES - 1) / LPC_FRAME_SAMPLES;
+	Uint32 (*residual)[LPC_FRAME_SAMPLES] = malloc(sizeof(*residual) * (LPC_MAX_ORDER + 1));
+	Uint32 *offset = malloc(sizeof(*offset) * (frames + 1));
+	
+	BitWriter bw;
+	bw_init(&bw);
+	bw_reserve(&bw, frames * sizeof(Uint32));
+	bw.byte = frames * sizeof(Uint32); // space for the offset table
+	
+	for (Uint32 f = 0 ; f < frames ; ++f)
+	{
+		const Sint16 *x = data + f * LPC_FRAME_SAMPLES;
+		const int length = my_min(LPC_FRAME_SAMPLES, n - f * LPC_FRAME_SAMPLES);
+		
+		offset[f] = bw_tell(&bw) / 8;
+		
+		// Use the predictor with the smallest residuals
+		
+		int order = 0;
+		Uint64 best_sum = 0;
+		
+		for (int o = 0 ; o <= LPC_MAX_ORDER && o <= length ; ++o)
+		{
+			Uint64 sum = lpc_residuals(x, length, o, residual[o]);
+			
+			if (o == 0 || sum < best_sum)
+			{
+				best_sum = sum;
+				order = o;
+			}
+		}
+		
+		bw_bits(&bw, order, 2);
+		
+		for (int i = 0 ; i < order ; ++i)
+			bw_bits(&bw, (Uint16)x[i], 16);
+			
+		for (int p = 0 ; p < length ; p += LPC_PARTITION_SAMPLES)
+		{
+			const int begin = my_max(p, order);
+			const int end = my_min(p + LPC_PARTITION_SAMPLES, length);
+			const Uint32 *r = residual[order];
+			const int k = rice_best_k(r + begin, end - begin);
+			
+			bw_bits(&bw, k, LPC_K_BITS);
+			
+			if (k != LPC_K_ZERO)
+				for (int i = begin ; i < end ; ++i)
+					bw_rice(&bw, r[i], k);
+		}
+		
+		bw_bits(&bw, 0, -bw_tell(&bw) & 7);
+	}
+	
+	bw_flush_all(&bw);
+	
+	*packed_size = bw_tell(&bw);
+	
+	for (Uint32 f = 0 ; f < frames ; ++f)
+		for (int b = 0 ; b < sizeof(Uint32) ; ++b)
+			bw.buffer[f * sizeof(Uint32) + b] = offset[f] >> (b * 8);
+	
+	free(offset);
+	free(residual);
+	
+	return bw.buffer;
+}
+
+
+static int lpc_decode_frame(BitReader *br, Sint16 *x, int length)
+{
+	Sint64 order = br_bits(br, 2);
+	
+	if (order < 0 || order > length) 
+		return 0;
+	
+	for (int i = 0 ; i < order ; ++i)
+	{
+		Sint64 v = br_bits(br, 16);
+		
+		if (v < 0) 
+			return 0;
+			
+		x[i] = v;
+	}
+	
+	const int *c = lpc_coeffs[order];
+	Sint32 x1 = order >= 1 ? x[order - 1] : 0;
+	Sint32 x2 = order >= 2 ? x[order - 2] : 0;
+	Sint32 x3 = order >= 3 ? x[order - 3] : 0;
+	
+	for (int p = 0 ; p < length ; p += LPC_PARTITION_SAMPLES)
+	{
+		const int end = my_min(p + LPC_PARTITION_SAMPLES, length);
+		Sint64 k = br_bits(br, LPC_K_BITS);
+		
+		if (k < 0 || (k >= LPC_RAW_BITS && k != LPC_K_ZERO)) 
+			return 0;
+		
+		if (k == LPC_K_ZERO)
+		{
+			for (int i = my_max(p, order) ; i < end ; ++i)
+			{
+				const Sint32 v = lpc_predict(c, x1, x2, x3);
+				
+				if (v < -32768 || v > 32767)
+					return 0;
+				
+				x[i] = v;
+				x3 = x2;
+				x2 = x1;
+				x1 = v;
+			}
+			
+			continue;
+		}
+		
+		const Uint32 kmask = (1 << k) - 1;
+		
+		for (int i = my_max(p, order) ; i < end ; ++i)
+		{
+			if (br->count < LPC_MAX_CODE_BITS)
+				br_refill(br);
+				
+			// Bits past the end of the stream are always zero so they never look like a terminating one
+			
+			const int valid = my_min(br->count, br->left);
+			const int q = br_ctz(br->buffer | (1 << LPC_RICE_ESCAPE));
+			Uint32 value;
+			
+			if (q < LPC_RICE_ESCAPE)
+			{
+				if (q + 1 + k > valid)
+					return 0;
+				
+				value = ((Uint32)q << k) | ((Uint32)(br->buffer >> (q + 1)) & kmask);
+				br_skip(br, q + 1 + k);
+			}
+			else
+			{
+				if (LPC_MAX_CODE_BITS > valid)
+					return 0;
+				
+				value = (br->buffer >> LPC_RICE_ESCAPE) & ((1 << LPC_RAW_BITS) - 1);
+				br_skip(br, LPC_MAX_CODE_BITS);
+			}
+			
+			const Sint32 v = lpc_predict(c, x1, x2, x3) + unzigzag(value);
+			
+			if (v < -32768 || v > 32767)
+				return 0;
+			
+			x[i] = v;
+			x3 = x2;
+			x2 = x1;
+			x1 = v;
+		}
+	}
+	
+	return 1;
+}
+
+
+static Uint32 lpc_frame_offset(const Uint8 *packed_data, Uint32 frame)
+{
+	const Uint8 *p = packed_data + frame * sizeof(Uint32);
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((Uint32)p[3] << 24);
+}
+
+
+/* Decompress data packed with lpcpack(), unpacked_size is the number of samples */
+Sint16 * lpcunpack(const Uint8 *packed_data, const Uint32 packed_size, Uint32 unpacked_size)
+{
+	const Uint32 frames = (unpacked_size + LPC_FRAME_SAMPLES - 1) / LPC_FRAME_SAMPLES;
+	const Uint32 bytes = packed_size / 8;
+	
+	if (bytes / sizeof(Uint32) < frames)
+		return NULL;
+	
+	Sint16 *buffer = malloc(sizeof(Sint16) * my_max(1, unpacked_size));
+	
+	for (Uint32 f = 0 ; f < frames ; ++f)
+	{
+		const Uint32 begin = lpc_frame_offset(packed_data, f);
+		const Uint32 end = f + 1 < frames ? lpc_frame_offset(packed_data, f + 1) : bytes;
+		
+		if (begin < frames * sizeof(Uint32) || begin > end || end > bytes)
+			goto read_error;
+		
+		BitReader br;
+		br_init(&br, packed_data + begin, (end - begin) * 8);
+		
+		if (!lpc_decode_frame(&br, buffer + f * LPC_FRAME_SAMPLES, my_min(LPC_FRAME_SAMPLES, unpacked_size - f * LPC_FRAME_SAMPLES)))
+			goto read_error;
+	}
+	
+	if (0)
+	{
+read_error:
+		free(buffer);
+		return NULL;
+	}
+	
+	return buffer;
 }
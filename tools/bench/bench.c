@@ -0,0 +1,311 @@
+/*
+Copyright (c) 2009-2010 Tero Lindeman (kometbomb)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+/* Times cyd_output_buffer_stereo() on synthetic songs that each stress one part of the synth, results are printed as CSV */
+
+#include "snd/music.h"
+#include "snd/freqs.h"
+#include "macros.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_CHANNELS 8
+#define BENCH_STEPS 64
+#define BENCH_BUFFER 4096
+#undef main
+
+typedef struct
+{
+	const char *name;
+	void (*setup)(MusInstrument *inst, CydFxSerialized *fx);
+} BenchCase;
+
+
+static void setup_pulse(MusInstrument *inst, CydFxSerialized *fx)
+{
+	inst->cydflags = CYD_CHN_ENABLE_PULSE;
+	inst->pwm_speed = 10;
+	inst->pwm_depth = 30;
+}
+
+
+static void setup_noise_metal(MusInstrument *inst, CydFxSerialized *fx)
+{
+	inst->cydflags = CYD_CHN_ENABLE_NOISE|CYD_CHN_ENABLE_METAL;
+}
+
+
+static void setup_lfsr(MusInstrument *inst, CydFxSerialized *fx)
+{
+	inst->cydflags = CYD_CHN_ENABLE_LFSR;
+	inst->lfsr_type = 3;
+}
+
+
+static void setup_wave(MusInstrument *inst, CydFxSerialized *fx)
+{
+	inst->cydflags = CYD_CHN_ENABLE_WAVE;
+	inst->wavetable_entry = 0;
+}
+
+
+static void setup_fm(MusInstrument *inst, CydFxSerialized *fx)
+{
+	inst->cydflags = CYD_CHN_ENABLE_SAW|CYD_CHN_ENABLE_FM;
+	inst->fm_modulation = 90;
+	inst->fm_feedback = 5;
+	inst->fm_harmonic = 0x21;
+	inst->fm_adsr.a = 2;
+	inst->fm_adsr.d = 10;
+	inst->fm_adsr.s = 8;
+}
+
+
+static void setup_filter(MusInstrument *inst, CydFxSerialized *fx)
+{
+	inst->cydflags = CYD_CHN_ENABLE_SAW|CYD_CHN_ENABLE_FILTER;
+	inst->flags |= MUS_INST_SET_CUTOFF;
+	inst->cutoff = 600;
+	inst->resonance = 3;
+	inst->flttype = FLT_LP;
+}
+
+
+static void setup_fx(MusInstrument *inst, CydFxSerialized *fx)
+{
+	inst->cydflags = CYD_CHN_ENABLE_PULSE|CYD_CHN_ENABLE_FX;
+	inst->fx_bus = 0;
+}
+
+
+static void setup_reverb(MusInstrument *inst, CydFxSerialized *fx)
+{
+	setup_fx(inst, fx);
+	fx->flags = CYDFX_ENABLE_REVERB;
+
+	for (int i = 0 ; i < CYDRVB_TAPS ; ++i)
+	{
+		fx->rvb.tap[i].delay = 30 + i * 97;
+		fx->rvb.tap[i].gain = -(i + 2) * 20;
+		fx->rvb.tap[i].panning = (i * 9) % 128;
+		fx->rvb.tap[i].flags = 1;
+	}
+}
+
+
+static void setup_chorus(MusInstrument *inst, CydFxSerialized *fx)
+{
+	setup_fx(inst, fx);
+	fx->flags = CYDFX_ENABLE_CHORUS;
+	fx->chr.rate = 12;
+	fx->chr.min_delay = 20;
+	fx->chr.max_delay = 80;
+	fx->chr.sep = 30;
+}
+
+
+static void setup_crush(MusInstrument *inst, CydFxSerialized *fx)
+{
+	setup_fx(inst, fx);
+	fx->flags = CYDFX_ENABLE_CRUSH|CYDFX_ENABLE_CRUSH_DITHER;
+	fx->crush.bit_drop = 5;
+	fx->crushex.downsample = 3;
+	fx->crushex.gain = 100;
+}
+
+
+static const BenchCase cases[] =
+{
+	{ "pulse", setup_pulse },
+	{ "noise_metal", setup_noise_metal },
+	{ "lfsr", setup_lfsr },
+	{ "wave_pingpong", setup_wave },
+	{ "fm_feedback", setup_fm },
+	{ "filter", setup_filter },
+	{ "reverb", setup_reverb },
+	{ "chorus", setup_chorus },
+	{ "crush", setup_crush },
+};
+
+
+/* Every channel plays the same instrument with a new note every few steps, all the channels are busy all the time */
+
+static void setup_song(MusSong *song, MusPattern *pattern, MusStep *steps, MusSeqPattern *sequence, MusInstrument *inst, const BenchCase *bench)
+{
+	memset(song, 0, sizeof(*song));
+	song->num_channels = BENCH_CHANNELS;
+	song->song_length = BENCH_STEPS;
+	song->song_speed = 6;
+	song->song_speed2 = 6;
+	song->song_rate = 50;
+	song->master_volume = MAX_VOLUME;
+	song->num_instruments = 1;
+	song->instrument = inst;
+	song->num_patterns = BENCH_CHANNELS;
+	song->pattern = pattern;
+
+	mus_get_default_instrument(inst);
+	inst->adsr.a = 1;
+	inst->adsr.d = 8;
+	inst->adsr.s = 24;
+	inst->adsr.r = 8;
+	bench->setup(inst, &song->fx[0]);
+
+	for (int c = 0 ; c < BENCH_CHANNELS ; ++c)
+	{
+		pattern[c].num_steps = BENCH_STEPS;
+		pattern[c].step = &steps[c * BENCH_STEPS];
+
+		for (int s = 0 ; s < BENCH_STEPS ; ++s)
+		{
+			MusStep *step = &pattern[c].step[s];
+			step->note = s % 8 == 0 ? 36 + (c * 5 + s) % 36 : MUS_NOTE_NONE;
+			step->instrument = s % 8 == 0 ? 0 : MUS_NOTE_NO_INSTRUMENT;
+			step->volume = MUS_NOTE_NO_VOLUME;
+			step->ctrl = 0;
+			step->command = 0;
+		}
+
+		song->num_sequences[c] = 1;
+		song->sequence[c] = &sequence[c];
+		sequence[c].position = 0;
+		sequence[c].pattern = c;
+		sequence[c].note_offset = 0;
+		song->default_volume[c] = MAX_VOLUME;
+		song->default_panning[c] = (c * 17) % 64 - 32;
+	}
+}
+
+
+static Uint64 get_ticks(Uint64 *freq)
+{
+#if SDL_VERSION_ATLEAST(2,0,0)
+	*freq = SDL_GetPerformanceFrequency();
+	return SDL_GetPerformanceCounter();
+#else
+	*freq = 1000;
+	return SDL_GetTicks();
+#endif
+}
+
+
+static double run_case(const BenchCase *bench, int sample_rate, int oversample, int seconds)
+{
+	static Sint16 wave[4096];
+	static Sint16 buffer[BENCH_BUFFER * 2];
+	static MusStep steps[BENCH_CHANNELS * BENCH_STEPS];
+	MusPattern pattern[BENCH_CHANNELS];
+	MusSeqPattern sequence[BENCH_CHANNELS];
+	MusInstrument inst;
+	MusSong song;
+	CydEngine cyd;
+	MusEngine mus;
+
+	setup_song(&song, pattern, steps, sequence, &inst, bench);
+
+	cyd_init(&cyd, sample_rate, 1);
+	cyd.flags |= CYD_SINGLE_THREAD;
+	cyd_set_oversampling(&cyd, oversample);
+	mus_init_engine(&mus, &cyd);
+
+	for (int i = 0 ; i < 4096 ; ++i)
+		wave[i] = sin(i * 0.05) * 20000 + ((i * 7919) % 2000) - 1000;
+
+	cyd_wave_entry_init(&cyd.wavetable_entries[0], wave, 4096, CYD_WAVE_TYPE_SINT16, 1, 1, 1);
+	cyd.wavetable_entries[0].flags = CYD_WAVE_LOOP|CYD_WAVE_PINGPONG;
+	cyd.wavetable_entries[0].loop_begin = 1000;
+	cyd.wavetable_entries[0].loop_end = 3000;
+	cyd.wavetable_entries[0].sample_rate = 22050;
+	cyd.wavetable_entries[0].base_note = MIDDLE_C << 8;
+
+	cyd_reserve_channels(&cyd, song.num_channels);
+	cyd_set_callback(&cyd, mus_advance_tick, &mus, song.song_rate);
+	mus_set_fx(&mus, &song);
+	mus_set_song(&mus, &song, 0);
+
+	const Uint64 frames = (Uint64)sample_rate * seconds;
+	Uint64 freq, start = get_ticks(&freq);
+
+	for (Uint64 done = 0 ; done < frames ; done += BENCH_BUFFER)
+	{
+		memset(buffer, 0, sizeof(buffer));
+		cyd_output_buffer_stereo(&cyd, (Uint8*)buffer, sizeof(buffer));
+	}
+
+	Uint64 end = get_ticks(&freq);
+
+	mus_set_song(&mus, NULL, 0);
+	cyd_deinit(&cyd);
+
+	return (double)(end - start) / freq;
+}
+
+
+int main(int argc, char **argv)
+{
+	static const int rates[] = { 22050, 44100, 48000, 96000 };
+	int seconds = 2;
+	const char *only = NULL;
+
+	for (int i = 1 ; i < argc ; ++i)
+	{
+		if (strcmp(argv[i], "-s") == 0 && i + 1 < argc)
+			seconds = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc)
+			only = argv[++i];
+		else
+		{
+			fprintf(stderr, "Usage: %s [-s seconds per run] [-c case]\n\n", argv[0]);
+			return 1;
+		}
+	}
+
+	seconds = my_max(1, seconds);
+
+	printf("case,sample_rate,oversample,channels,frames,seconds,samples_per_second,ns_per_sample_per_channel\n");
+
+	for (int c = 0 ; c < sizeof(cases) / sizeof(cases[0]) ; ++c)
+	{
+		if (only && strcmp(only, cases[c].name) != 0)
+			continue;
+
+		for (int r = 0 ; r < sizeof(rates) / sizeof(rates[0]) ; ++r)
+		{
+			for (int oversample = 0 ; oversample <= 4 ; ++oversample)
+			{
+				const double t = run_case(&cases[c], rates[r], oversample, seconds);
+				const Uint64 frames = ((Uint64)rates[r] * seconds + BENCH_BUFFER - 1) / BENCH_BUFFER * BENCH_BUFFER;
+
+				printf("%s,%d,%d,%d,%llu,%.6f,%.0f,%.2f\n", cases[c].name, rates[r], oversample, BENCH_CHANNELS,
+					(unsigned long long)frames, t, frames / t, t * 1e9 / frames / BENCH_CHANNELS);
+				fflush(stdout);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,377 @@
+/*
+Copyright (c) 2009-2010 Tero Lindeman (kometbomb)
+
+Permission is hereby granted, free of charge, to any person
+obtaining a copy of this software and associated documentation
+files (the "Software"), to deal in the Software without
+restriction, including without limitation the rights to use,
+copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the
+Software is furnished to do so, subject to the following
+conditions:
+
+The above copyright notice and this permission notice shall be
+included in all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES
+OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT
+HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY,
+WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR
+OTHER DEALINGS IN THE SOFTWARE.
+*/
+
+
+/* Renders klystrack songs to WAV or raw 16-bit stereo PCM without an audio device, several files in parallel */
+
+#include "snd/music.h"
+#include "macros.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define RENDER_CHUNK 4096
+#undef main
+
+typedef struct
+{
+	int sample_rate, oversample, loops, fade_ms, raw, jobs;
+	const char *out_dir;
+	char **files;
+	int n_files, next_file, errors;
+	SDL_mutex *mutex;
+} RenderOptions;
+
+typedef struct
+{
+	RenderOptions *opt;
+	CydEngine cyd;
+	MusEngine mus;
+	MusSong song;
+	int loops_left, fading, fade_start; // fading is set when the last loop has been played
+} RenderJob;
+
+
+static void write_u32(FILE *f, Uint32 v)
+{
+	Uint8 b[4] = { v, v >> 8, v >> 16, v >> 24 };
+	fwrite(b, 1, 4, f);
+}
+
+
+static void write_u16(FILE *f, Uint16 v)
+{
+	Uint8 b[2] = { v, v >> 8 };
+	fwrite(b, 1, 2, f);
+}
+
+
+static void write_wav_header(FILE *f, int sample_rate, Uint32 data_size)
+{
+	fwrite("RIFF", 1, 4, f);
+	write_u32(f, 36 + data_size);
+	fwrite("WAVEfmt ", 1, 8, f);
+	write_u32(f, 16);
+	write_u16(f, 1); // PCM
+	write_u16(f, 2);
+	write_u32(f, sample_rate);
+	write_u32(f, sample_rate * 2 * sizeof(Sint16));
+	write_u16(f, 2 * sizeof(Sint16));
+	write_u16(f, 16);
+	fwrite("data", 1, 4, f);
+	write_u32(f, data_size);
+}
+
+
+static Uint64 get_ticks(Uint64 *freq)
+{
+#if SDL_VERSION_ATLEAST(2,0,0)
+	*freq = SDL_GetPerformanceFrequency();
+	return SDL_GetPerformanceCounter();
+#else
+	*freq = 1000;
+	return SDL_GetTicks();
+#endif
+}
+
+
+/* Wraps mus_advance_tick() to stop after the requested number of loops */
+
+static int render_tick(void *udata)
+{
+	RenderJob *job = udata;
+	const int prev = job->mus.song_position;
+
+	// a song that ends by itself is not faded
+	if (!mus_advance_tick(&job->mus))
+		return 0;
+
+	// the song wrapped to the loop point if a new row was started at or before the previous one
+	if (job->mus.song_counter == 0 && job->mus.song_position <= prev && --job->loops_left == 0)
+	{
+		job->fading = 1;
+		job->fade_start = job->cyd.samples_output; // frames rendered so far by cyd_output_buffer_planar()
+
+		if (job->opt->fade_ms == 0)
+			return 0;
+	}
+
+	return 1;
+}
+
+
+static void make_output_path(const RenderOptions *opt, const char *path, char *out, size_t size)
+{
+	const char *name = path;
+
+	if (opt->out_dir)
+	{
+		for (const char *c = path ; *c ; ++c)
+			if (*c == '/' || *c == '\\') name = c + 1;
+
+		snprintf(out, size, "%s/%s", opt->out_dir, name);
+	}
+	else
+	{
+		snprintf(out, size, "%s", path);
+	}
+
+	char *ext = strrchr(out, '.');
+
+	if (ext && !strchr(ext, '/') && !strchr(ext, '\\'))
+		*ext = '\0';
+
+	strncat(out, opt->raw ? ".raw" : ".wav", size - strlen(out) - 1);
+}
+
+
+static int render_file(RenderJob *job, const char *path, double *seconds, double *realtime)
+{
+	const RenderOptions *opt = job->opt;
+	char out_path[1024];
+
+	make_output_path(opt, path, out_path, sizeof(out_path));
+
+	cyd_init(&job->cyd, opt->sample_rate, 1);
+	job->cyd.flags |= CYD_SINGLE_THREAD;
+	cyd_set_oversampling(&job->cyd, opt->oversample);
+	mus_init_engine(&job->mus, &job->cyd);
+
+	memset(&job->song, 0, sizeof(job->song));
+
+	if (!mus_load_song(path, &job->song, job->cyd.wavetable_entries))
+	{
+		fprintf(stderr, "%s: cannot load song\n", path);
+		cyd_deinit(&job->cyd);
+		return 0;
+	}
+
+	FILE *f = fopen(out_path, "wb");
+
+	if (!f)
+	{
+		fprintf(stderr, "%s: cannot create file\n", out_path);
+		mus_free_song(&job->song);
+		cyd_deinit(&job->cyd);
+		return 0;
+	}
+
+	if (!opt->raw)
+		write_wav_header(f, opt->sample_rate, 0);
+
+	job->loops_left = opt->loops;
+	job->fading = 0;
+	job->fade_start = 0;
+
+	cyd_reserve_channels(&job->cyd, job->song.num_channels);
+	cyd_set_callback(&job->cyd, render_tick, job, job->song.song_rate);
+	mus_set_fx(&job->mus, &job->song);
+	mus_set_song(&job->mus, &job->song, 0);
+
+	const int max_frames = 0x7fffffff / (2 * sizeof(Sint16)) - RENDER_CHUNK;
+	const int fade_frames = (Sint64)opt->fade_ms * opt->sample_rate / 1000;
+	int fade = fade_frames, frames = 0;
+	Sint32 left[RENDER_CHUNK], right[RENDER_CHUNK];
+	Sint16 pcm[RENDER_CHUNK * 2];
+
+	Uint64 freq, start = get_ticks(&freq);
+
+	while (frames < max_frames)
+	{
+		const int was_fading = job->fading;
+		int n = cyd_output_buffer_planar(&job->cyd, left, right, RENDER_CHUNK);
+
+		// the fade starts at the end of the last loop, possibly in the middle of the chunk
+		if (job->fading && fade_frames > 0)
+		{
+			for (int i = was_fading ? 0 : job->fade_start ; i < n ; ++i)
+			{
+				--fade;
+				left[i] = (Sint64)left[i] * fade / fade_frames;
+				right[i] = (Sint64)right[i] * fade / fade_frames;
+
+				if (fade == 0)
+				{
+					n = i + 1;
+					break;
+				}
+			}
+		}
+
+		for (int i = 0 ; i < n ; ++i)
+		{
+			Sint32 l = my_min(32767, my_max(-32768, left[i]));
+			Sint32 r = my_min(32767, my_max(-32768, right[i]));
+			Uint16 ul = l, ur = r;
+			Uint8 *b = (Uint8*)&pcm[i * 2];
+
+			b[0] = ul;
+			b[1] = ul >> 8;
+			b[2] = ur;
+			b[3] = ur >> 8;
+		}
+
+		fwrite(pcm, 2 * sizeof(Sint16), n, f);
+		frames += n;
+
+		if (n < RENDER_CHUNK || (job->fading && fade == 0))
+			break;
+	}
+
+	Uint64 end = get_ticks(&freq);
+
+	if (!opt->raw)
+	{
+		fseek(f, 0, SEEK_SET);
+		write_wav_header(f, opt->sample_rate, frames * 2 * sizeof(Sint16));
+	}
+
+	fclose(f);
+
+	mus_free_song(&job->song);
+	cyd_deinit(&job->cyd);
+
+	*seconds = (double)frames / opt->sample_rate;
+	*realtime = end > start ? *seconds / ((double)(end - start) / freq) : 0;
+
+	return 1;
+}
+
+
+static int render_thread(void *udata)
+{
+	RenderJob *job = calloc(1, sizeof(*job));
+	RenderOptions *opt = udata;
+
+	job->opt = opt;
+
+	for (;;)
+	{
+		SDL_LockMutex(opt->mutex);
+		const int idx = opt->next_file++;
+		SDL_UnlockMutex(opt->mutex);
+
+		if (idx >= opt->n_files)
+			break;
+
+		double seconds, realtime;
+		const int ok = render_file(job, opt->files[idx], &seconds, &realtime);
+
+		SDL_LockMutex(opt->mutex);
+
+		if (ok)
+			printf("%s: %.1f s, %.1fx realtime\n", opt->files[idx], seconds, realtime);
+		else
+			++opt->errors;
+
+		SDL_UnlockMutex(opt->mutex);
+	}
+
+	free(job);
+
+	return 0;
+}
+
+
+int main(int argc, char **argv)
+{
+	RenderOptions opt = { 44100, 0, 1, 0, 0, 1, NULL };
+	int first_path;
+
+	for (first_path = 1 ; first_path < argc ; ++first_path)
+	{
+		const char *a = argv[first_path];
+
+		if (a[0] != '-')
+			break;
+
+		if (strcmp(a, "-raw") == 0)
+		{
+			opt.raw = 1;
+			continue;
+		}
+
+		if (first_path + 1 >= argc)
+		{
+			fprintf(stderr, "Missing value for %s\n", a);
+			return 1;
+		}
+
+		const char *v = argv[++first_path];
+
+		if (strcmp(a, "-r") == 0) opt.sample_rate = atoi(v);
+		else if (strcmp(a, "-q") == 0) opt.oversample = atoi(v);
+		else if (strcmp(a, "-l") == 0) opt.loops = atoi(v);
+		else if (strcmp(a, "-f") == 0) opt.fade_ms = atoi(v);
+		else if (strcmp(a, "-j") == 0) opt.jobs = atoi(v);
+		else if (strcmp(a, "-o") == 0) opt.out_dir = v;
+		else
+		{
+			fprintf(stderr, "Unknown option %s\n", a);
+			return 1;
+		}
+	}
+
+	if (first_path >= argc || opt.sample_rate <= 0 || opt.loops < 1 || opt.fade_ms < 0)
+	{
+		fprintf(stderr, "Usage: %s [-r rate] [-q oversample] [-l loops] [-f fade ms] [-j jobs] [-o output dir] [-raw] <songs ...>\n\n", argv[0]);
+		fputs("Renders each song to a .wav (or .raw, 16-bit stereo little-endian) file next to the song or in the output dir.\n", stderr);
+		fputs("A song is played loops times and then faded out over the fade time. Songs that do not repeat end where they stop.\n", stderr);
+		fputs("Use -j 0 to run a job per CPU core.\n", stderr);
+		return 1;
+	}
+
+	opt.files = &argv[first_path];
+	opt.n_files = argc - first_path;
+	opt.oversample = my_min(4, my_max(0, opt.oversample));
+
+	if (opt.jobs <= 0)
+		opt.jobs = SDL_GetCPUCount();
+
+	opt.jobs = my_max(1, my_min(opt.jobs, opt.n_files));
+	opt.mutex = SDL_CreateMutex();
+
+	SDL_Thread **threads = calloc(opt.jobs, sizeof(*threads));
+
+	// The main thread runs one job itself
+
+	for (int i = 1 ; i < opt.jobs ; ++i)
+	{
+#if SDL_VERSION_ATLEAST(1,3,0)
+		threads[i] = SDL_CreateThread(render_thread, "Render", &opt);
+#else
+		threads[i] = SDL_CreateThread(render_thread, &opt);
+#endif
+	}
+
+	render_thread(&opt);
+
+	for (int i = 1 ; i < opt.jobs ; ++i)
+		SDL_WaitThread(threads[i], NULL);
+
+	free(threads);
+	SDL_DestroyMutex(opt.mutex);
+
+	return opt.errors ? 1 : 0;
+}